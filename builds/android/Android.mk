@@ -20,7 +20,7 @@ include $(PREBUILT_SHARED_LIBRARY)
 include $(CLEAR_VARS)
 LOCAL_MODULE := filemq
 LOCAL_C_INCLUDES := ../../include $(LIBZMQ)/include
-LOCAL_SRC_FILES := fmq_msg.c fmq_server.c fmq_client.c
+LOCAL_SRC_FILES := fmq_msg.c fmq_server.c fmq_client.c fmq_merkle.c fmq_journal.c fmq_blocks.c
 LOCAL_SHARED_LIBRARIES := zmq
 include $(BUILD_SHARED_LIBRARY)
 
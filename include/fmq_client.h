@@ -58,6 +58,19 @@ zactor_t *
 //  we send/recv high volume message data to a second pipe, the msgpipe. In
 //  the low-volume case we can do everything over the actor pipe, if traffic
 //  is never ambiguous.
+//
+//  The client reports each change to its inbox on the msgpipe, as four
+//  string frames:
+//
+//      "FILE UPDATED", inbox, filename, digest
+//          The file at filename in the inbox is new or changed. Digest is
+//          the SHA-1 digest of its content, or empty if we don't know it.
+//      "FILE DELETED", inbox, filename, ""
+//          The file at filename is gone from the inbox.
+//
+//  Filename is relative to the inbox. A move is a deletion of the old name
+//  followed by an update of the new one. A file the client could not get
+//  intact is not reported; the inbox keeps the version it had.
 zsock_t *
     fmq_client_msgpipe (fmq_client_t *self);
 
@@ -3,14 +3,13 @@
     
     Codec header for fmq_msg.
 
-    ** WARNING *************************************************************
-    THIS SOURCE FILE IS 100% GENERATED. If you edit this file, you will lose
-    your changes at the next build cycle. This is great for temporary printf
-    statements. DO NOT MAKE ANY CHANGES YOU WISH TO KEEP. The correct places
-    for commits are:
-
-     * The XML model used for this code generation: fmq_msg.xml, or
-     * The code generation script that built this file: zproto_codec_c
+    ** NOTE ****************************************************************
+    This file was first generated from fmq_msg.xml by zproto_codec_c, and
+    is now maintained by hand, as the template does not decode chunks as
+    frame views, send them as trailing frames, or reuse storage between
+    messages. It is no longer part of 'make code'. When you change a
+    message in fmq_msg.xml, make the same change to fmq_msg.h and fmq_msg.c,
+    then set FMQ_MSG_MODEL in fmq_msg.c to the digest the selftest reports.
     ************************************************************************
     Copyright (c) the Contributors as noted in the AUTHORS file.       
     This file is part of FileMQ, a C implemenation of the protocol:    
@@ -39,6 +38,7 @@
         cache               hash        File SHA-1 signatures
 
     ICANHAZ_OK - Server confirms the subscription
+        cache               hash        Directories that differ
 
     NOM - Client sends credit to the server
         credit              number 8    Credit, in bytes
@@ -46,7 +46,7 @@
 
     CHEEZBURGER - The server sends a file chunk
         sequence            number 8    File offset in bytes
-        operation           number 1    Create=%d1 delete=%d2
+        operation           number 1    Create=%d1 delete=%d2 move=%d3 attr=%d4 copy=%d5
         filename            longstr     Relative name of file
         offset              number 8    File offset in bytes
         eof                 number 1    Last chunk in file?
@@ -59,6 +59,10 @@
 
     KTHXBAI - Client closes the peering
 
+    IHAZ - Client already holds the file it is being sent
+        filename            longstr     Relative name of file
+        headers             hash        File properties
+
     SRSLY - Server refuses client due to access rights
         reason              string      Printable explanation, 255 characters
 
@@ -69,6 +73,9 @@
 #define FMQ_MSG_VERSION                     2
 #define FMQ_MSG_FILE_CREATE                 1
 #define FMQ_MSG_FILE_DELETE                 2
+#define FMQ_MSG_FILE_MOVE                   3
+#define FMQ_MSG_FILE_ATTR                   4
+#define FMQ_MSG_FILE_COPY                   5
 
 #define FMQ_MSG_OHAI                        1
 #define FMQ_MSG_OHAI_OK                     4
@@ -79,6 +86,7 @@
 #define FMQ_MSG_HUGZ                        9
 #define FMQ_MSG_HUGZ_OK                     10
 #define FMQ_MSG_KTHXBAI                     11
+#define FMQ_MSG_IHAZ                        12
 #define FMQ_MSG_SRSLY                       128
 #define FMQ_MSG_RTFM                        129
 
@@ -211,6 +219,26 @@ zchunk_t *
 //  Set the chunk field, transferring ownership from caller
 void
     fmq_msg_set_chunk (fmq_msg_t *self, zchunk_t **chunk_p);
+//  Set the chunk field to the data of a frame, sharing rather than copying
+//  it; the caller keeps its own reference to the frame
+void
+    fmq_msg_set_chunk_frame (fmq_msg_t *self, zmq_msg_t *frame);
+//  Get a reference to the frame holding the chunk, and the chunk's offset
+//  in it, without copying the data; the caller closes the frame
+int
+    fmq_msg_chunk_frame (fmq_msg_t *self, zmq_msg_t *frame, size_t *offset_p);
+//  Get the chunk data without copying it; for a received message this is
+//  valid until the next receive
+const byte *
+    fmq_msg_chunk_data (fmq_msg_t *self);
+//  Get the chunk size, in bytes
+size_t
+    fmq_msg_chunk_size (fmq_msg_t *self);
+//  Get/set whether the chunk travels as a trailing frame
+bool
+    fmq_msg_chunk_trailing (fmq_msg_t *self);
+void
+    fmq_msg_set_chunk_trailing (fmq_msg_t *self, bool chunk_trailing);
 
 //  Get/set the reason field
 const char *
@@ -0,0 +1,167 @@
+/*  =========================================================================
+    filemq_bench - server load with many idle clients
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.
+    This file is part of FileMQ, a C implemenation of the protocol:
+    https://github.com/danriegsecker/filemq2.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    Connects many simulated clients to one server, has each of them send
+    HUGZ once per heartbeat, and reports the CPU the process spends while
+    they sit idle. The clients share one ROUTER socket that connects once
+    per client with its own routing id, so we don't need a socket per
+    client. Each client still takes two file handles, so raise the open
+    file limit (ulimit -n) to match.
+@discuss
+@end
+*/
+
+#include "filemq_classes.h"
+#if defined (__UNIX__)
+#   include <sys/resource.h>
+#endif
+
+#define BENCH_ENDPOINT  "ipc://filemq_bench.ipc"
+
+//  Return process CPU time, in msecs
+
+static int64_t
+s_cpu_msecs (void)
+{
+#if defined (__UNIX__)
+    struct rusage usage;
+    getrusage (RUSAGE_SELF, &usage);
+    return (int64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000
+         + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+#else
+    return 0;
+#endif
+}
+
+//  Receive and count whatever the server has sent us so far
+
+static int
+s_drain (zsock_t *router, fmq_msg_t *msg, int id)
+{
+    int count = 0;
+    while (zsock_events (router) & ZMQ_POLLIN) {
+        if (fmq_msg_recv (msg, router))
+            break;
+        if (fmq_msg_id (msg) == id)
+            count++;
+    }
+    return count;
+}
+
+int main (int argc, char *argv [])
+{
+    int clients = 100000;
+    int seconds = 10;
+    int heartbeat = 1000;
+    bool verbose = false;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "-n") && argn + 1 < argc)
+            clients = atoi (argv [++argn]);
+        else
+        if (streq (argv [argn], "-t") && argn + 1 < argc)
+            seconds = atoi (argv [++argn]);
+        else
+        if (streq (argv [argn], "-h") && argn + 1 < argc)
+            heartbeat = atoi (argv [++argn]);
+        else
+        if (streq (argv [argn], "-v"))
+            verbose = true;
+        else
+            clients = 0;
+    }
+    if (clients < 1 || heartbeat < 1) {
+        puts ("usage: filemq_bench [-n clients] [-t seconds] [-h heartbeat] [-v]");
+        return 0;
+    }
+#if defined (ZMQ_CONNECT_RID)
+    zactor_t *server = zactor_new (fmq_server, "filemq_bench");
+    if (verbose)
+        zstr_send (server, "VERBOSE");
+    zstr_sendx (server, "BIND", BENCH_ENDPOINT, NULL);
+
+    zsock_t *router = zsock_new (ZMQ_ROUTER);
+    zsock_set_unbounded (router);
+    fmq_msg_t *msg = fmq_msg_new ();
+    zframe_t **routing_ids = (zframe_t **) zmalloc (clients * sizeof (zframe_t *));
+
+    //  Connect every client and say OHAI
+    int64_t start = zclock_mono ();
+    int client_nbr;
+    for (client_nbr = 0; client_nbr < clients; client_nbr++) {
+        char rid [16];
+        snprintf (rid, sizeof (rid), "C%08d", client_nbr);
+        zmq_setsockopt (zsock_resolve (router), ZMQ_CONNECT_RID, rid, strlen (rid));
+        if (zsock_connect (router, BENCH_ENDPOINT)) {
+            zsys_error ("could not connect client %d, check ulimit -n", client_nbr);
+            clients = client_nbr;
+            break;
+        }
+        routing_ids [client_nbr] = zframe_new (rid, strlen (rid));
+        fmq_msg_set_id (msg, FMQ_MSG_OHAI);
+        fmq_msg_set_routing_id (msg, routing_ids [client_nbr]);
+        fmq_msg_send (msg, router);
+    }
+    int welcomed = 0;
+    while (welcomed < clients && !zsys_interrupted
+    &&     zclock_mono () - start < 60000) {
+        welcomed += s_drain (router, msg, FMQ_MSG_OHAI_OK);
+        zclock_sleep (10);
+    }
+    zsys_info ("filemq_bench: %d of %d clients connected in %d msecs",
+        welcomed, clients, (int) (zclock_mono () - start));
+    if (!clients)
+        seconds = 0;
+
+    //  Each client sends HUGZ once per heartbeat, spread evenly across it
+    int64_t cpu_start = s_cpu_msecs ();
+    start = zclock_mono ();
+    int64_t sent = 0;
+    int answered = 0;
+    client_nbr = 0;
+    while (!zsys_interrupted && zclock_mono () - start < seconds * 1000) {
+        int64_t due = (zclock_mono () - start) * clients / heartbeat;
+        while (sent < due) {
+            fmq_msg_set_id (msg, FMQ_MSG_HUGZ);
+            fmq_msg_set_routing_id (msg, routing_ids [client_nbr]);
+            fmq_msg_send (msg, router);
+            client_nbr = (client_nbr + 1) % clients;
+            sent++;
+        }
+        answered += s_drain (router, msg, FMQ_MSG_HUGZ_OK);
+        zclock_sleep (10);
+    }
+    int64_t elapsed = zclock_mono () - start;
+    int64_t cpu_used = s_cpu_msecs () - cpu_start;
+    zsys_info ("filemq_bench: %d clients, %d HUGZ sent, %d answered",
+        clients, (int) sent, answered);
+    zsys_info ("filemq_bench: %d msecs CPU in %d msecs (%d%%)",
+        (int) cpu_used, (int) elapsed,
+        elapsed? (int) (cpu_used * 100 / elapsed): 0);
+
+    for (client_nbr = 0; client_nbr < clients; client_nbr++)
+        zframe_destroy (&routing_ids [client_nbr]);
+    free (routing_ids);
+    fmq_msg_destroy (&msg);
+    zsock_destroy (&router);
+    zactor_destroy (&server);
+#else
+    puts ("filemq_bench needs libzmq 4.1 or later, for ZMQ_CONNECT_RID");
+    if (verbose)
+        zsys_debug ("filemq_bench: not running %d clients for %d seconds",
+            clients, seconds);
+#endif
+    return 0;
+}
@@ -22,5 +22,8 @@
 #include "../include/filemq.h"
 
 //  Internal API
+#include "fmq_merkle.h"
+#include "fmq_journal.h"
+#include "fmq_blocks.h"
 
 #endif
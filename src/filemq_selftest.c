@@ -35,6 +35,9 @@ main (int argc, char *argv [])
     fmq_msg_test (verbose); 
     fmq_server_test (verbose); 
     fmq_client_test (verbose); 
+    fmq_merkle_test (verbose); 
+    fmq_journal_test (verbose); 
+    fmq_blocks_test (verbose); 
 
     printf ("Tests passed OK\n");
     return 0;
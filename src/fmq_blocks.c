@@ -0,0 +1,344 @@
+/*  =========================================================================
+    fmq_blocks - content-defined blocks of a file
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.
+    This file is part of FileMQ, a C implemenation of the protocol:
+    https://github.com/danriegsecker/filemq2.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    Splits a file into blocks at boundaries chosen by content, and gives
+    the SHA-1 digest of each block, so identical regions of different
+    files, or of one file before and after an edit, give identical blocks.
+    We cut one block at a time, as the caller asks for it, so a large file
+    never has to be read in one go.
+@discuss
+    We cut blocks FastCDC style: a gear hash rolls over the data, and we
+    cut where its top bits are all zero. We never cut before BLOCK_MIN
+    bytes and always cut at BLOCK_MAX. Below BLOCK_AVERAGE we test more
+    bits than above it, which pulls block sizes in towards the average.
+    Since the gear hash depends on the last 64 bytes alone, an edit moves
+    only the boundaries near it, and the blocks after those realign.
+@end
+*/
+
+#include "filemq_classes.h"
+
+#define BLOCK_MIN       (16 * 1024)
+#define BLOCK_AVERAGE   (64 * 1024)
+#define BLOCK_MAX       (256 * 1024)
+#define BUFFER_SIZE     BLOCK_MAX
+
+//  Cut masks, testing 18 bits below the average size and 14 above it
+#define MASK_SMALL      (~(uint64_t) 0 << 46)
+#define MASK_LARGE      (~(uint64_t) 0 << 50)
+
+//  Block in the file
+typedef struct {
+    off_t offset;               //  Offset in file
+    size_t length;              //  Length in bytes
+    char *digest;               //  SHA-1 digest, in hex
+} s_block_t;
+
+//  Structure of our class
+
+struct _fmq_blocks_t {
+    s_block_t *blocks;          //  Blocks in file order
+    size_t size;                //  Number of blocks
+    size_t max_size;            //  Number of blocks allocated
+    FILE *handle;               //  File we're cutting, until its end
+    byte *buffer;               //  Data read from file
+    size_t filled;              //  Bytes of data in buffer
+    size_t cursor;              //  Bytes of buffer already cut
+    off_t offset;               //  Offset in file of next block
+    bool failed;                //  We couldn't read the whole file
+    uint64_t gear [256];        //  Gear hash table
+};
+
+
+//  --------------------------------------------------------------------------
+//  Fill the gear table, the same for every peer, from a fixed seed
+
+static void
+s_gear_fill (uint64_t *gear)
+{
+    uint64_t state = 0x46696c654d51ULL;
+    uint index;
+    for (index = 0; index < 256; index++) {
+        //  SplitMix64
+        uint64_t value = (state += 0x9e3779b97f4a7c15ULL);
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+        gear [index] = value ^ (value >> 31);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Append a block to the list
+
+static void
+s_blocks_append (fmq_blocks_t *self, off_t offset, size_t length,
+                 const char *digest)
+{
+    if (self->size == self->max_size) {
+        self->max_size = self->max_size? self->max_size * 2: 16;
+        self->blocks = (s_block_t *) realloc (self->blocks,
+            self->max_size * sizeof (s_block_t));
+        assert (self->blocks);
+    }
+    s_block_t *block = &self->blocks [self->size++];
+    block->offset = offset;
+    block->length = length;
+    block->digest = strdup (digest);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Open the file at filename to split into content-defined blocks. We cut
+//  no blocks yet; call fmq_blocks_more for each one. Returns NULL if the
+//  file can't be read.
+
+fmq_blocks_t *
+fmq_blocks_new (const char *filename)
+{
+    FILE *handle = fopen (filename, "rb");
+    if (!handle)
+        return NULL;
+
+    fmq_blocks_t *self = (fmq_blocks_t *) zmalloc (sizeof (fmq_blocks_t));
+    assert (self);
+    self->handle = handle;
+    self->buffer = (byte *) malloc (BUFFER_SIZE);
+    assert (self->buffer);
+    s_gear_fill (self->gear);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Cut the next block of the file and digest it, reading at most a little
+//  more than BLOCK_MAX bytes. Returns 0 if we added a block, or -1 at the
+//  end of the file or if we can't read it; fmq_blocks_failed says which.
+
+int
+fmq_blocks_more (fmq_blocks_t *self)
+{
+    assert (self);
+    if (!self->handle)
+        return -1;
+
+    zdigest_t *digest = zdigest_new ();
+    uint64_t hash = 0;
+    size_t length = 0;
+    bool cut = false;
+    while (!cut) {
+        if (self->cursor == self->filled) {
+            self->filled = fread (self->buffer, 1, BUFFER_SIZE, self->handle);
+            self->cursor = 0;
+            if (self->filled == 0)
+                break;
+        }
+        size_t start = self->cursor;
+        while (self->cursor < self->filled) {
+            hash = (hash << 1) + self->gear [self->buffer [self->cursor++]];
+            length++;
+            if (length >= BLOCK_MAX
+            || (length >= BLOCK_MIN
+            &&  (hash & (length < BLOCK_AVERAGE? MASK_SMALL: MASK_LARGE)) == 0)) {
+                cut = true;
+                break;
+            }
+        }
+        zdigest_update (digest, self->buffer + start, self->cursor - start);
+    }
+    int rc = -1;
+    if (cut || (length && !ferror (self->handle))) {
+        s_blocks_append (self, self->offset, length, zdigest_string (digest));
+        self->offset += length;
+        rc = 0;
+    }
+    else {
+        //  End of file, or a read error; either way we're done with it
+        self->failed = ferror (self->handle) != 0;
+        fclose (self->handle);
+        self->handle = NULL;
+    }
+    zdigest_destroy (&digest);
+    return rc;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return true if we couldn't read the whole file
+
+bool
+fmq_blocks_failed (fmq_blocks_t *self)
+{
+    assert (self);
+    return self->failed;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return true once we've cut the whole file into blocks
+
+bool
+fmq_blocks_done (fmq_blocks_t *self)
+{
+    assert (self);
+    return self->handle == NULL && !self->failed;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy a block list
+
+void
+fmq_blocks_destroy (fmq_blocks_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        fmq_blocks_t *self = *self_p;
+        size_t index;
+        for (index = 0; index < self->size; index++)
+            free (self->blocks [index].digest);
+        free (self->blocks);
+        free (self->buffer);
+        if (self->handle)
+            fclose (self->handle);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the number of blocks cut so far
+
+size_t
+fmq_blocks_size (fmq_blocks_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the offset in the file of the block at index
+
+off_t
+fmq_blocks_offset (fmq_blocks_t *self, size_t index)
+{
+    assert (self);
+    assert (index < self->size);
+    return self->blocks [index].offset;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the length of the block at index
+
+size_t
+fmq_blocks_length (fmq_blocks_t *self, size_t index)
+{
+    assert (self);
+    assert (index < self->size);
+    return self->blocks [index].length;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the SHA-1 digest of the block at index, as a hex string
+
+const char *
+fmq_blocks_digest (fmq_blocks_t *self, size_t index)
+{
+    assert (self);
+    assert (index < self->size);
+    return self->blocks [index].digest;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Selftest
+
+static void
+s_test_write (const char *filename, const byte *data, size_t size)
+{
+    FILE *handle = fopen (filename, "wb");
+    assert (handle);
+    size_t rc = fwrite (data, 1, size, handle);
+    assert (rc == size);
+    fclose (handle);
+}
+
+void
+fmq_blocks_test (bool verbose)
+{
+    printf (" * fmq_blocks: ");
+
+    //  @selftest
+    size_t size = 2 * 1024 * 1024;
+    byte *data = (byte *) malloc (size + 1000);
+    assert (data);
+    uint32_t state = 1;
+    size_t index;
+    for (index = 0; index < size + 1000; index++) {
+        state = state * 1103515245 + 12345;
+        data [index] = (byte) (state >> 16);
+    }
+    //  The second file has 1000 bytes in front of the first
+    s_test_write ("./fmqblocks.one", data + 1000, size);
+    s_test_write ("./fmqblocks.two", data, size + 1000);
+
+    fmq_blocks_t *one = fmq_blocks_new ("./fmqblocks.one");
+    assert (one);
+    assert (fmq_blocks_size (one) == 0);
+    assert (fmq_blocks_more (one) == 0);
+    assert (fmq_blocks_size (one) == 1);
+    while (fmq_blocks_more (one) == 0)
+        ;
+    assert (fmq_blocks_done (one));
+    assert (!fmq_blocks_failed (one));
+    assert (fmq_blocks_more (one) == -1);
+    assert (fmq_blocks_size (one) > 1);
+    off_t offset = 0;
+    for (index = 0; index < fmq_blocks_size (one); index++) {
+        assert (fmq_blocks_offset (one, index) == offset);
+        assert (fmq_blocks_length (one, index) <= BLOCK_MAX);
+        offset += fmq_blocks_length (one, index);
+    }
+    assert (offset == (off_t) size);
+
+    //  All but the first block or so of the first file turn up again
+    fmq_blocks_t *two = fmq_blocks_new ("./fmqblocks.two");
+    assert (two);
+    while (fmq_blocks_more (two) == 0)
+        ;
+    zhash_t *digests = zhash_new ();
+    for (index = 0; index < fmq_blocks_size (two); index++)
+        zhash_insert (digests, fmq_blocks_digest (two, index), (void *) "");
+    size_t shared = 0;
+    for (index = 0; index < fmq_blocks_size (one); index++)
+        if (zhash_lookup (digests, fmq_blocks_digest (one, index)))
+            shared++;
+    assert (shared + 2 >= fmq_blocks_size (one));
+    zhash_destroy (&digests);
+
+    fmq_blocks_destroy (&one);
+    fmq_blocks_destroy (&two);
+    assert (fmq_blocks_new ("./fmqblocks.none") == NULL);
+    zsys_file_delete ("./fmqblocks.one");
+    zsys_file_delete ("./fmqblocks.two");
+    free (data);
+    //  @end
+
+    printf ("OK\n");
+}
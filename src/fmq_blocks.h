@@ -0,0 +1,73 @@
+/*  =========================================================================
+    fmq_blocks - content-defined blocks of a file
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.
+    This file is part of FileMQ, a C implemenation of the protocol:
+    https://github.com/danriegsecker/filemq2.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef __FMQ_BLOCKS_H_INCLUDED__
+#define __FMQ_BLOCKS_H_INCLUDED__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _fmq_blocks_t fmq_blocks_t;
+
+//  @interface
+//  Open the file at filename to split into content-defined blocks. We cut
+//  no blocks yet; call fmq_blocks_more for each one. Returns NULL if the
+//  file can't be read.
+fmq_blocks_t *
+    fmq_blocks_new (const char *filename);
+
+//  Cut the next block of the file and digest it, reading at most a little
+//  more than BLOCK_MAX bytes. Returns 0 if we added a block, or -1 at the
+//  end of the file or if we can't read it; fmq_blocks_failed says which.
+int
+    fmq_blocks_more (fmq_blocks_t *self);
+
+//  Return true if we couldn't read the whole file
+bool
+    fmq_blocks_failed (fmq_blocks_t *self);
+
+//  Return true once we've cut the whole file into blocks
+bool
+    fmq_blocks_done (fmq_blocks_t *self);
+
+//  Destroy a block list
+void
+    fmq_blocks_destroy (fmq_blocks_t **self_p);
+
+//  Return the number of blocks cut so far
+size_t
+    fmq_blocks_size (fmq_blocks_t *self);
+
+//  Return the offset in the file of the block at index
+off_t
+    fmq_blocks_offset (fmq_blocks_t *self, size_t index);
+
+//  Return the length of the block at index
+size_t
+    fmq_blocks_length (fmq_blocks_t *self, size_t index);
+
+//  Return the SHA-1 digest of the block at index, as a hex string
+const char *
+    fmq_blocks_digest (fmq_blocks_t *self, size_t index);
+
+//  Self test of this class
+void
+    fmq_blocks_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -21,6 +21,12 @@
 
 //  TODO: Change these to match your project's needs
 #include "filemq_classes.h"
+#if defined (__UNIX__)
+#   include <utime.h>
+#endif
+#if defined (__UTYPE_LINUX)
+#   include <fcntl.h>
+#endif
 
 //  Forward reference to method arguments structure
 typedef struct _client_args_t client_args_t;
@@ -32,6 +38,22 @@ typedef struct _sub_t sub_t;
 #define CREDIT_SLICE    1000000
 #define CREDIT_MINIMUM  (CREDIT_SLICE * 4) + 1
 
+//  We upload our cache in batches of this many entries, so no single
+//  ICANHAZ gets too large however many files we hold
+#define CACHE_BATCH     10000
+
+//  We keep our position in the server's journal next to the inbox, named
+//  for the inbox with this suffix, so it outlives the client
+#define JOURNAL_SUFFIX  ".journal"
+
+//  We write each file we receive in a directory next to the inbox, named
+//  for the inbox with this suffix, and move it into the inbox once it is
+//  complete and checked, so a failed transfer leaves what we had
+#define PARTIAL_SUFFIX  ".partial"
+
+//  Largest block we'll copy from our own files when the server asks
+#define BLOCK_SIZE_MAX  (16 * 1024 * 1024)
+
 //  This structure defines the context for a client connection
 typedef struct {
     //  These properties must always be present in the client_t
@@ -46,11 +68,25 @@ typedef struct {
     
     //  TODO: Add specific properties for your application
     size_t credit;              //  Current credit pending
-    zfile_t *file;              //  File we're currently writing
+    zhash_t *files;             //  Files we're currently writing, by name
+    zhash_t *broken;            //  Files missing blocks we couldn't copy
+    zhash_t *contents;          //  Files we hold, by content digest
+    zhash_t *digests;           //  Content digests of files we're writing
+    zhash_t *streams;           //  Running digests of files we're writing
+    zactor_t *writer;           //  Writes chunks off the client thread
+    size_t queued;              //  Bytes handed to the writer, not written
+    size_t writes;              //  Chunks handed to the writer, not written
+    zhash_t *copied;            //  Files we copied, whose chunks we skip
+    zhash_t *resent;            //  Files we asked the server to resend
     char *inbox;                //  Path where files will be stored
+    char *partial;              //  Path where we write files until complete
     zlist_t *subs;              //  Our subscriptions
     sub_t *sub;                 //  Subscription we're sending
     int timeouts;               //  Count the timeouts
+    fmq_merkle_t *merkle;       //  Merkle tree over inbox, as last seen
+    zlist_t *cache_pending;     //  Cache keys still to upload
+    char *journal;              //  Our position in the server's journal
+    char *journal_due;          //  Position to save once files are whole
 } client_t;
 
 //  Include the generated client engine
@@ -61,8 +97,249 @@ struct _sub_t {
     client_t *client;           //  Pointer to parent client
     char *inbox;                //  Inbox location
     char *path;                 //  Path we subscribe to
+    zhash_t *names;             //  Inbox names we got under this path
 };
 
+//  Callback when we remove a file from the 'files' hash table
+static void
+s_file_free (void *argument)
+{
+    zfile_t *file = (zfile_t *) argument;
+    zfile_destroy (&file);
+}
+
+//  Chunk we hand to the writer, which writes it and hands it back. The
+//  job shares the frame we received the chunk in, so we never copy it. A
+//  job may instead name a block we hold, which the writer reads and
+//  checks, then writes.
+typedef struct {
+    zfile_t *file;              //  File to write to
+    char *filename;             //  Name of file in our inbox
+    off_t offset;               //  Offset to write at
+    zmq_msg_t frame;            //  Frame holding data to write
+    size_t frame_offset;        //  Offset of data in that frame
+    size_t size;                //  Size of data, in bytes
+    char *source;               //  File holding block to copy, if any
+    off_t source_offset;        //  Offset of block in that file
+    char *digest;               //  Digest the block must have
+    zchunk_t *block;            //  Block we read from that file
+    int rc;                     //  0 if written, -1 if not
+} write_t;
+
+//  Return the data a job writes, or NULL if it has none
+static byte *
+s_job_data (write_t *job)
+{
+    if (job->source)
+        return job->block? zchunk_data (job->block): NULL;
+    return (byte *) zmq_msg_data (&job->frame) + job->frame_offset;
+}
+
+static void
+s_job_destroy (write_t **job_p)
+{
+    write_t *job = *job_p;
+    zmq_msg_close (&job->frame);
+    zchunk_destroy (&job->block);
+    free (job->filename);
+    free (job->source);
+    free (job->digest);
+    free (job);
+    *job_p = NULL;
+}
+
+//  Running digest of a file we're writing, fed as chunks arrive, so we
+//  can check the file at its end without reading it back
+typedef struct {
+    zdigest_t *digest;          //  Digest of content so far
+    off_t offset;               //  Offset we've digested up to
+    bool valid;                 //  False once we lose track of content
+} stream_t;
+
+static stream_t *
+stream_new (void)
+{
+    stream_t *self = (stream_t *) zmalloc (sizeof (stream_t));
+    self->digest = zdigest_new ();
+    self->valid = true;
+    return self;
+}
+
+static void
+stream_destroy (stream_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        stream_t *self = *self_p;
+        zdigest_destroy (&self->digest);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Callback when we remove a stream from the 'streams' hash table
+static void
+s_stream_free (void *argument)
+{
+    stream_t *stream = (stream_t *) argument;
+    stream_destroy (&stream);
+}
+
+//  Digest zeros up to offset, for holes the server skipped
+static void
+s_stream_fill (stream_t *self, off_t offset)
+{
+    static byte zeros [8192];
+    while (self->offset < offset) {
+        size_t size = sizeof (zeros);
+        if ((off_t) size > offset - self->offset)
+            size = (size_t) (offset - self->offset);
+        zdigest_update (self->digest, zeros, size);
+        self->offset += size;
+    }
+}
+
+//  Add data written at offset to the digest. The server sends each file
+//  in order, so data behind what we've digested means we lose track.
+static void
+stream_update (stream_t *self, off_t offset, byte *data, size_t size)
+{
+    if (!self || !self->valid)
+        return;
+    if (offset < self->offset)
+        self->valid = false;
+    else {
+        s_stream_fill (self, offset);
+        zdigest_update (self->digest, data, size);
+        self->offset += size;
+    }
+}
+
+//  Return the digest of the file, which ends at size, or NULL if we lost
+//  track of its content
+static const char *
+stream_finish (stream_t *self, off_t size)
+{
+    if (!self || !self->valid || self->offset > size)
+        return NULL;
+    s_stream_fill (self, size);
+    return zdigest_string (self->digest);
+}
+
+//  Cut or extend a file we're writing to size bytes; what we extend it by
+//  is a hole, which reads as zeros. Returns -1 where the platform can't,
+//  so the caller knows old data may remain.
+static int
+s_file_truncate (zfile_t *file, off_t size)
+{
+    FILE *handle = zfile_handle (file);
+    fflush (handle);
+#if defined (__UNIX__)
+    return ftruncate (fileno (handle), size);
+#elif defined (__WINDOWS__)
+    return _chsize_s (_fileno (handle), size);
+#else
+    return -1;
+#endif
+}
+
+//  Seek to offset in a file; plain fseek takes a long, which is 32 bits
+//  on some platforms, so files past 2 GB need the wider calls
+static int
+s_file_seek (FILE *handle, off_t offset)
+{
+#if defined (__UNIX__)
+    return fseeko (handle, offset, SEEK_SET);
+#elif defined (__WINDOWS__)
+    return _fseeki64 (handle, (__int64) offset, SEEK_SET);
+#else
+    if (offset != (long) offset)
+        return -1;
+    return fseek (handle, (long) offset, SEEK_SET);
+#endif
+}
+
+//  Move a file to target, replacing any file there; rename does that in
+//  one step on POSIX, but not on Windows
+static int
+s_file_replace (const char *source, const char *target)
+{
+#if defined (__WINDOWS__)
+    return MoveFileExA (source, target, MOVEFILE_REPLACE_EXISTING)? 0: -1;
+#else
+    return rename (source, target);
+#endif
+}
+
+//  Reserve disk space for a file we're about to write, size bytes, so it's
+//  laid out in one piece and we don't grow it chunk by chunk. We keep the
+//  file's size, and where the filesystem can't reserve we do without;
+//  posix_fallocate would instead write the whole file full of zeros.
+static void
+s_file_reserve (zfile_t *file, off_t size)
+{
+#if defined (__UTYPE_LINUX) && defined (FALLOC_FL_KEEP_SIZE)
+    FILE *handle = zfile_handle (file);
+    if (fallocate (fileno (handle), FALLOC_FL_KEEP_SIZE, 0, size))
+        zsys_debug ("unable to reserve %lld bytes", (long long) size);
+#endif
+}
+
+//  Read size bytes at offset in the file at path, and check they have the
+//  digest given. Returns the block, or NULL if we don't hold it after all.
+static zchunk_t *
+s_block_read (const char *path, off_t offset, size_t size, const char *digest)
+{
+    FILE *source = fopen (path, "rb");
+    if (!source)
+        return NULL;
+
+    zchunk_t *chunk = NULL;
+    if (s_file_seek (source, offset) == 0) {
+        chunk = zchunk_read (source, size);
+        if (zchunk_size (chunk) != size
+        ||  strneq (zchunk_digest (chunk), digest))
+            zchunk_destroy (&chunk);
+    }
+    fclose (source);
+    return chunk;
+}
+
+//  Writer actor. Writes each chunk the client hands it, off the client
+//  thread, and hands the chunk back. It reads blocks we copy here too, so
+//  the client thread never waits on the disk. We flush each chunk so a
+//  failed write shows up in its own job, and the client marks that file
+//  broken. The client touches no file that has chunks waiting here.
+static void
+s_writer (zsock_t *pipe, void *args)
+{
+    zsock_signal (pipe, 0);
+    while (true) {
+        char *command = NULL;
+        write_t *job = NULL;
+        if (zsock_recv (pipe, "sp", &command, &job))
+            break;              //  Interrupted
+        bool terminated = streq (command, "$TERM");
+        zstr_free (&command);
+        if (terminated)
+            break;
+        if (job->source)
+            job->block = s_block_read (job->source, job->source_offset,
+                                       job->size, job->digest);
+        FILE *handle = zfile_handle (job->file);
+        byte *data = s_job_data (job);
+        size_t size = job->size;
+        if (data
+        &&  s_file_seek (handle, job->offset) == 0
+        &&  fwrite (data, 1, size, handle) == size
+        &&  fflush (handle) == 0)
+            job->rc = 0;
+        else
+            job->rc = -1;
+        zsock_send (pipe, "p", job);
+    }
+}
+
 static sub_t *
 sub_new (client_t *client, char *inbox, char *path)
 {
@@ -70,6 +347,7 @@ sub_new (client_t *client, char *inbox, char *path)
     self->client = client;
     self->inbox = strdup (inbox);
     self->path = strdup (path);
+    self->names = zhash_new ();
     return self;
 }
 
@@ -81,11 +359,322 @@ sub_destroy (sub_t **self_p)
         sub_t *self = *self_p;
         free (self->inbox);
         free (self->path);
+        zhash_destroy (&self->names);
         free (self);
         *self_p = NULL;
     }
 }
 
+//  Every subscription shares our inbox, so a name in it may hold a file
+//  we got under another subscription. Return true if a subscription other
+//  than sub gave us the file at name.
+
+static bool
+client_name_elsewhere (client_t *self, sub_t *sub, const char *name)
+{
+    sub_t *other = (sub_t *) zlist_first (self->subs);
+    while (other) {
+        if (other != sub && zhash_lookup (other->names, name))
+            return true;
+        other = (sub_t *) zlist_next (self->subs);
+    }
+    return false;
+}
+
+//  Note that sub gave us the file at name, or that nobody did if sub is
+//  NULL
+
+static void
+client_name_claim (client_t *self, sub_t *sub, const char *name)
+{
+    if (sub && zhash_lookup (sub->names, name))
+        return;
+    sub_t *other = (sub_t *) zlist_first (self->subs);
+    while (other) {
+        if (other != sub)
+            zhash_delete (other->names, name);
+        other = (sub_t *) zlist_next (self->subs);
+    }
+    if (sub)
+        zhash_insert (sub->names, name, (void *) "");
+}
+
+//  Return the name of a file or directory next to our inbox, named for
+//  the inbox with the given suffix
+
+static char *
+s_inbox_sibling (client_t *self, const char *suffix)
+{
+    char *inbox = strdup (self->inbox);
+    size_t length = strlen (inbox);
+    while (length > 1 && inbox [length - 1] == '/')
+        inbox [--length] = 0;
+    char *filename = zsys_sprintf ("%s%s", inbox, suffix);
+    free (inbox);
+    return filename;
+}
+
+//  Load our journal position, if we have one
+
+static void
+client_journal_load (client_t *self)
+{
+    char *filename = s_inbox_sibling (self, JOURNAL_SUFFIX);
+    FILE *handle = fopen (filename, "r");
+    if (handle) {
+        char buffer [256];
+        if (fgets (buffer, sizeof (buffer), handle)) {
+            buffer [strcspn (buffer, "\r\n")] = 0;
+            free (self->journal);
+            self->journal = *buffer? strdup (buffer): NULL;
+        }
+        fclose (handle);
+    }
+    free (filename);
+}
+
+//  Save our journal position, once we've applied every change up to it
+
+static void
+client_journal_save (client_t *self, const char *position)
+{
+    if (self->journal && streq (self->journal, position))
+        return;
+    free (self->journal);
+    self->journal = strdup (position);
+    char *filename = s_inbox_sibling (self, JOURNAL_SUFFIX);
+    FILE *handle = fopen (filename, "w");
+    if (handle) {
+        fprintf (handle, "%s\n", position);
+        fclose (handle);
+    }
+    else
+        zsys_warning ("unable to save journal position to %s", filename);
+    free (filename);
+}
+
+//  Stop uploading our cache. We keep the Merkle tree, so that next time
+//  we only digest files that have changed.
+
+static void
+client_cache_end (client_t *self)
+{
+    zlist_destroy (&self->cache_pending);
+}
+
+//  Index the files in our inbox by content digest, from the Merkle tree,
+//  so when the server sends us content we hold already we can copy it.
+//  The index may go stale; we check the digest of whatever we copy.
+
+static void
+client_contents_load (client_t *self)
+{
+    zhash_purge (self->contents);
+    zlist_t *files = fmq_merkle_files (self->merkle);
+    const char *path = (const char *) zlist_first (files);
+    while (path) {
+        const char *digest = fmq_merkle_digest (self->merkle, path);
+        if (digest)
+            zhash_insert (self->contents, digest, (void *) path);
+        path = (const char *) zlist_next (files);
+    }
+    zlist_destroy (&files);
+}
+
+//  Put the next batch of our cache into the ICANHAZ, as digests keyed by
+//  path relative to the subscription; directory keys end in '/'. If more
+//  batches follow we say so in the options; the server merges each batch
+//  into what it has. We leave out files we got under other subscriptions.
+//  Only our first subscription asks the server to resync us, deleting what
+//  it doesn't have; a later one would delete the files of the others.
+
+static void
+client_cache_batch (client_t *self)
+{
+    zhash_t *cache = zhash_new ();
+    zhash_autofree (cache);
+    size_t count = 0;
+    while (self->cache_pending
+    &&     zlist_size (self->cache_pending)
+    &&     count < CACHE_BATCH) {
+        char *key = (char *) zlist_pop (self->cache_pending);
+        const char *digest = fmq_merkle_digest (self->merkle, key);
+        if (digest && !client_name_elsewhere (self, self->sub, key)) {
+            //  A file we say we hold is this subscription's from now on
+            if (key [strlen (key) - 1] != '/')
+                client_name_claim (self, self->sub, key);
+            zhash_insert (cache, key, (void *) digest);
+            count++;
+        }
+        free (key);
+    }
+    //  Ask the server to send chunks as trailing frames, which we can
+    //  write from without copying, to compare directory digests, to send
+    //  what we're missing once it has our cache, and to move files we
+    //  hold rather than resend them, to update file properties alone when
+    //  only those change, to let us copy files and blocks of large
+    //  files from files we hold, and to tell us the content of large
+    //  files so we can copy it if we hold it; older servers ignore these
+    //  options
+    zhash_t *options = zhash_new ();
+    zhash_autofree (options);
+    zhash_insert (options, "CHUNK-FRAME", "1");
+    zhash_insert (options, "MERKLE", "1");
+    if (zlist_size (self->subs) == 1)
+        zhash_insert (options, "RESYNC", "1");
+    zhash_insert (options, "MOVE", "1");
+    zhash_insert (options, "ATTR", "1");
+    zhash_insert (options, "BLOCKS", "1");
+    zhash_insert (options, "COPY", "1");
+    zhash_insert (options, "IHAZ", "1");
+    if (self->journal)
+        zhash_insert (options, "JOURNAL", self->journal);
+    if (self->cache_pending && zlist_size (self->cache_pending))
+        zhash_insert (options, "CACHE", "more");
+    fmq_msg_set_options (self->message, &options);
+    fmq_msg_set_cache (self->message, &cache);
+}
+
+//  ---------------------------------------------------------------------------
+//  Take back the next chunk the writer is done with, waiting for it if
+//  need be, and digest what it wrote. A chunk the writer couldn't write,
+//  or a block it couldn't copy, leaves its file broken.
+
+static void
+client_writer_done (client_t *self)
+{
+    write_t *job = NULL;
+    if (zsock_recv (zactor_sock (self->writer), "p", &job) || !job) {
+        //  Interrupted, so we're going down anyhow
+        self->queued = 0;
+        self->writes = 0;
+        return;
+    }
+    self->queued -= job->size;
+    self->writes--;
+    if (job->rc == 0) {
+        //  The writer works in order, and we sync it before we end,
+        //  restart, or drop a file, so its stream is still current
+        stream_t *stream =
+            (stream_t *) zhash_lookup (self->streams, job->filename);
+        stream_update (stream, job->offset, s_job_data (job), job->size);
+    }
+    else {
+        if (job->source && !job->block)
+            zsys_warning ("unable to copy block for %s/%s", self->inbox,
+                job->filename);
+        else
+            zsys_warning ("unable to write to file %s/%s", self->inbox,
+                job->filename);
+        zhash_update (self->broken, job->filename, (void *) "");
+    }
+    s_job_destroy (&job);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Wait until the writer has written all we handed it
+
+static void
+client_writer_sync (client_t *self)
+{
+    while (self->writes)
+        client_writer_done (self);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Create a job for the writer to write to file at offset
+
+static write_t *
+client_job_new (client_t *self, const char *filename, zfile_t *file,
+                off_t offset)
+{
+    write_t *job = (write_t *) zmalloc (sizeof (write_t));
+    assert (job);
+    job->file = file;
+    job->filename = strdup (filename);
+    job->offset = offset;
+    zmq_msg_init (&job->frame);
+    return job;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Hand a job to the writer. The credit we give the server bounds what
+//  the writer has in hand, so we never wait for it here.
+
+static void
+client_job_send (client_t *self, write_t *job)
+{
+    self->queued += job->size;
+    self->writes++;
+    zsock_send (zactor_sock (self->writer), "sp", "WRITE", job);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Hand the chunk in the message we received to the writer, to write to
+//  file at offset. The writer gets another reference to the frame that
+//  holds the chunk, which it releases once written. Returns 0 if OK, -1
+//  if we could not share the frame.
+
+static int
+client_write (client_t *self, const char *filename, zfile_t *file,
+              off_t offset)
+{
+    write_t *job = client_job_new (self, filename, file, offset);
+    job->size = fmq_msg_chunk_size (self->message);
+    if (fmq_msg_chunk_frame (self->message, &job->frame, &job->frame_offset)) {
+        s_job_destroy (&job);
+        return -1;
+    }
+    client_job_send (self, job);
+    return 0;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return the credit we owe the server, and count it as given. Data the
+//  writer has yet to write counts against the credit we give, so a slow
+//  disk holds the server back, and we give credit back as the writer
+//  drains.
+
+static size_t
+client_credit_due (client_t *self)
+{
+    size_t credit_to_send = 0;
+    while (self->credit + self->queued < CREDIT_MINIMUM) {
+        credit_to_send += CREDIT_SLICE;
+        self->credit += CREDIT_SLICE;
+    }
+    return credit_to_send;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  zloop callback when the writer hands back chunks it wrote. As it
+//  drains we may give the server more credit; we send that straight
+//  away, as it changes nothing in our state machine.
+
+static int
+s_client_handle_writer (zloop_t *loop, zsock_t *reader, void *argument)
+{
+    s_client_t *engine = (s_client_t *) argument;
+    client_t *self = &engine->client;
+    while (self->writes && (zsock_events (reader) & ZMQ_POLLIN))
+        client_writer_done (self);
+    if (engine->state == subscribed_state) {
+        size_t credit = client_credit_due (self);
+        if (credit) {
+            fmq_msg_set_id (self->message, FMQ_MSG_NOM);
+            fmq_msg_set_credit (self->message, credit);
+            fmq_msg_send (self->message, self->dealer);
+        }
+    }
+    return 0;
+}
+
 //  Allocate properties and structures for a new client instance.
 //  Return 0 if OK, -1 if failed
 
@@ -94,6 +683,21 @@ client_initialize (client_t *self)
 {
     zsys_info ("client is initializing");
     self->subs = zlist_new ();
+    self->files = zhash_new ();
+    self->broken = zhash_new ();
+    zhash_autofree (self->broken);
+    self->contents = zhash_new ();
+    zhash_autofree (self->contents);
+    self->digests = zhash_new ();
+    zhash_autofree (self->digests);
+    self->streams = zhash_new ();
+    self->copied = zhash_new ();
+    zhash_autofree (self->copied);
+    self->resent = zhash_new ();
+    zhash_autofree (self->resent);
+    self->writer = zactor_new (s_writer, NULL);
+    engine_handle_socket (self, zactor_sock (self->writer),
+                          s_client_handle_writer);
     self->credit = 0;
     self->inbox = NULL;
     self->timeouts = 0;
@@ -114,6 +718,27 @@ client_terminate (client_t *self)
     }
     zlist_destroy (&self->subs);
     zsys_debug ("client_terminate: subscription list destroyed");
+    //  The writer may still hold chunks of files we're about to close
+    client_writer_sync (self);
+    zactor_destroy (&self->writer);
+    //  Files we didn't finish are of no use to anyone
+    zfile_t *file = (zfile_t *) zhash_first (self->files);
+    while (file) {
+        zfile_remove (file);
+        file = (zfile_t *) zhash_next (self->files);
+    }
+    zhash_destroy (&self->files);
+    zhash_destroy (&self->broken);
+    zhash_destroy (&self->contents);
+    zhash_destroy (&self->digests);
+    zhash_destroy (&self->streams);
+    zhash_destroy (&self->copied);
+    zhash_destroy (&self->resent);
+    client_cache_end (self);
+    fmq_merkle_destroy (&self->merkle);
+    free (self->journal);
+    free (self->journal_due);
+    free (self->partial);
     if (self->inbox) {
         free (self->inbox);
         zsys_debug ("client_terminate: inbox freed");
@@ -193,6 +818,355 @@ format_icanhaz_command (client_t *self)
     free (path);
 
     fmq_msg_set_path (self->message, self->sub->path);
+
+    //  Tell the server what we already hold so it doesn't resend it. We
+    //  start with the digest of our whole inbox, and open up directories
+    //  only as the server tells us they differ from its own.
+    client_cache_end (self);
+    zdir_t *inbox = zdir_new (self->inbox, NULL);
+    fmq_merkle_t *merkle = fmq_merkle_new (inbox, self->merkle);
+    fmq_merkle_destroy (&self->merkle);
+    self->merkle = merkle;
+    zdir_destroy (&inbox);
+    client_contents_load (self);
+    self->cache_pending = zlist_new ();
+    zlist_autofree (self->cache_pending);
+    zlist_append (self->cache_pending, (void *) "./");
+    client_cache_batch (self);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  check_for_cache_batch
+//
+
+static void
+check_for_cache_batch (client_t *self)
+{
+    //  Queue what we hold in each directory the server says differs
+    zhash_t *differ = fmq_msg_cache (self->message);
+    if (differ && self->cache_pending) {
+        const char *digest = (const char *) zhash_first (differ);
+        while (digest) {
+            const char *key = zhash_cursor (differ);
+            zhash_t *children = fmq_merkle_children (self->merkle, key);
+            const char *child = children?
+                (const char *) zhash_first (children): NULL;
+            while (child) {
+                const char *name = zhash_cursor (children);
+                if (streq (key, "./"))
+                    zlist_append (self->cache_pending, (void *) name);
+                else {
+                    char *path = (char *) malloc (strlen (key) + strlen (name) + 1);
+                    sprintf (path, "%s%s", key, name);
+                    zlist_append (self->cache_pending, path);
+                    free (path);
+                }
+                child = (const char *) zhash_next (children);
+            }
+            digest = (const char *) zhash_next (differ);
+        }
+    }
+    if (self->cache_pending && zlist_size (self->cache_pending)) {
+        fmq_msg_set_path (self->message, self->sub->path);
+        client_cache_batch (self);
+        engine_set_exception (self, cache_batch_event);
+    }
+    else
+        client_cache_end (self);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return the name in our inbox for a server vpath, by stripping the path
+//  of the subscription that the file falls under, matching whole path
+//  components only
+
+static const char *
+client_inbox_name (client_t *self, const char *filename)
+{
+    sub_t *subscr = (sub_t *) zlist_first (self->subs);
+    while (subscr) {
+        size_t length = strlen (subscr->path);
+        while (length && subscr->path [length - 1] == '/')
+            length--;
+        if (!strncmp (filename, subscr->path, length)
+        &&  (filename [length] == 0 || filename [length] == '/')) {
+            filename += length;
+            zsys_debug ("subscription found for %s", filename);
+            break;
+        }
+        subscr = (sub_t *) zlist_next (self->subs);
+    }
+    while ('/' == *filename) filename++;
+    return filename;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return the subscription a server vpath falls under, or NULL if none
+
+static sub_t *
+client_inbox_sub (client_t *self, const char *filename)
+{
+    sub_t *subscr = (sub_t *) zlist_first (self->subs);
+    while (subscr) {
+        size_t length = strlen (subscr->path);
+        while (length && subscr->path [length - 1] == '/')
+            length--;
+        if (!strncmp (filename, subscr->path, length)
+        &&  (filename [length] == 0 || filename [length] == '/'))
+            return subscr;
+        subscr = (sub_t *) zlist_next (self->subs);
+    }
+    return NULL;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Apply the file properties the server sent in the message headers, if
+//  any, to the file at filename in our inbox
+
+static void
+client_apply_headers (client_t *self, const char *filename)
+{
+#if defined (__UNIX__)
+    zhash_t *headers = fmq_msg_headers (self->message);
+    const char *mtime = headers?
+        (const char *) zhash_lookup (headers, "MTIME"): NULL;
+    const char *mode = headers?
+        (const char *) zhash_lookup (headers, "MODE"): NULL;
+    char *path = zsys_sprintf ("%s/%s", self->inbox, filename);
+    if (mode && chmod (path, (mode_t) strtol (mode, NULL, 8)))
+        zsys_warning ("unable to set mode of %s", path);
+    if (mtime) {
+        struct utimbuf times;
+        times.actime = times.modtime = (time_t) atoll (mtime);
+        if (utime (path, &times))
+            zsys_warning ("unable to set modification time of %s", path);
+    }
+    free (path);
+#endif
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return the credit the server charged for the chunk in hand: its size,
+//  or for a reference to a block we hold, the size of that block.
+
+static size_t
+client_chunk_cost (client_t *self)
+{
+    zhash_t *headers = fmq_msg_headers (self->message);
+    const char *size = headers?
+        (const char *) zhash_lookup (headers, "BLOCK-SIZE"): NULL;
+    if (headers && zhash_lookup (headers, "BLOCK"))
+        return size? (size_t) atoll (size): 0;
+    return fmq_msg_chunk_size (self->message);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Hand the writer a block that the server says we hold, in the file and
+//  at the offset its message headers name, to copy to file at offset. The
+//  writer reads the block and checks its digest. Returns 0 if OK, -1 if
+//  the headers don't name a block we could hold.
+
+static int
+client_copy_block (client_t *self, const char *filename, zfile_t *file,
+                   off_t offset)
+{
+    zhash_t *headers = fmq_msg_headers (self->message);
+    const char *vpath = (const char *) zhash_lookup (headers, "BLOCK");
+    const char *source = (const char *) zhash_lookup (headers, "BLOCK-OFFSET");
+    const char *size = (const char *) zhash_lookup (headers, "BLOCK-SIZE");
+    const char *digest = (const char *) zhash_lookup (headers, "BLOCK-DIGEST");
+    if (*vpath != '/' || !source || !size || !digest)
+        return -1;
+    size_t length = (size_t) atoll (size);
+    if (length == 0 || length > BLOCK_SIZE_MAX)
+        return -1;
+
+    write_t *job = client_job_new (self, filename, file, offset);
+    job->size = length;
+    job->source = zsys_sprintf ("%s/%s", self->inbox,
+                                client_inbox_name (self, vpath));
+    job->source_offset = (off_t) atoll (source);
+    job->digest = strdup (digest);
+    client_job_send (self, job);
+    return 0;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Move the file we wrote at filename beside our inbox into the inbox,
+//  replacing what we held there. Returns 0 if OK, -1 if not, in which case
+//  we remove the file we wrote and keep what we held.
+
+static int
+client_file_commit (client_t *self, const char *filename)
+{
+    char *source = zsys_sprintf ("%s/%s", self->partial, filename);
+    char *target = zsys_sprintf ("%s/%s", self->inbox, filename);
+    char *slash = strrchr (target, '/');
+    *slash = 0;
+    zsys_dir_create ("%s", target);
+    *slash = '/';
+    int rc = s_file_replace (source, target);
+    if (rc) {
+        zsys_warning ("unable to move %s to %s", source, target);
+        zsys_file_delete (source);
+    }
+    free (source);
+    free (target);
+    return rc;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Ask the server to send a file again, as it is now, when what we got of
+//  it failed its check or we could not copy it. We ask by IHAZ with the
+//  RESEND header, and ask once for each file; if the next attempt fails
+//  too, we fetch the file when we next subscribe.
+
+static void
+client_ask_resend (client_t *self, const char *filename)
+{
+    if (zhash_lookup (self->resent, filename))
+        return;
+    zhash_insert (self->resent, filename, (void *) "");
+    if (!fmq_msg_headers (self->message)) {
+        zhash_t *headers = zhash_new ();
+        zhash_autofree (headers);
+        fmq_msg_set_headers (self->message, &headers);
+    }
+    zhash_update (fmq_msg_headers (self->message), "RESEND", (void *) "1");
+    engine_set_exception (self, have_content_event);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Copy the file at from in our inbox to filename, checking that what we
+//  copy has the given content digest. We copy beside the inbox and move
+//  the copy in once checked. Returns 0 if OK, or -1 if we don't hold that
+//  content after all, in which case we keep what we held at filename.
+
+static int
+client_copy_file (client_t *self, const char *from, const char *filename,
+                  const char *digest)
+{
+    char *path = zsys_sprintf ("%s/%s", self->inbox, from);
+    FILE *source = fopen (path, "rb");
+    free (path);
+    if (!source)
+        return -1;
+
+    int rc = -1;
+    zfile_t *file = zfile_new (self->partial, filename);
+    if (zfile_output (file) == 0 && s_file_truncate (file, 0) == 0) {
+        FILE *handle = zfile_handle (file);
+        zdigest_t *check = zdigest_new ();
+        byte *data = (byte *) malloc (CREDIT_SLICE);
+        assert (data);
+        size_t bytes;
+        rc = 0;
+        while (rc == 0 && (bytes = fread (data, 1, CREDIT_SLICE, source)) > 0) {
+            zdigest_update (check, data, bytes);
+            if (fwrite (data, 1, bytes, handle) != bytes)
+                rc = -1;
+        }
+        if (ferror (source) || strneq (zdigest_string (check), digest))
+            rc = -1;
+        free (data);
+        zdigest_destroy (&check);
+        zfile_close (file);
+        if (rc)
+            zfile_remove (file);
+        else
+            rc = client_file_commit (self, filename);
+    }
+    zfile_destroy (&file);
+    fclose (source);
+    return rc;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return true if we copied the file we're receiving from content we hold
+//  already. The server gives us the content digest with the first chunk
+//  of a large file; if we hold that content under another name we copy
+//  it, and tell the server it can skip the rest of the file.
+
+static bool
+client_copy_content (client_t *self, const char *filename)
+{
+    //  A file the server starts afresh is a new version, not what we copied
+    zhash_t *headers = fmq_msg_headers (self->message);
+    if (headers && zhash_lookup (headers, "RESTART"))
+        zhash_delete (self->copied, filename);
+    if (zhash_lookup (self->copied, filename))
+        return true;
+    //  The digest on the last chunk is there for checking, not copying
+    const char *digest = headers?
+        (const char *) zhash_lookup (headers, "DIGEST"): NULL;
+    if (!digest || fmq_msg_eof (self->message))
+        return false;
+    zhash_update (self->digests, filename, (void *) digest);
+
+    //  If we've started on the file, copying blocks we hold, we carry on
+    const char *from = (const char *) zhash_lookup (self->contents, digest);
+    if (!from || streq (from, filename) || zhash_lookup (self->files, filename))
+        return false;
+    zsys_debug ("copy %s/%s to %s/%s", self->inbox, from, self->inbox,
+        filename);
+    if (client_copy_file (self, from, filename, digest)) {
+        zhash_delete (self->contents, digest);
+        return false;
+    }
+    zhash_insert (self->copied, filename, (void *) "");
+    zhash_delete (self->broken, filename);
+    zhash_update (self->contents, digest, (void *) filename);
+    //  Our IHAZ carries the same filename and digest
+    engine_set_exception (self, have_content_event);
+    return true;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Forget any file we're part way through writing at filename; the server
+//  won't finish sending that version
+
+static void
+client_file_drop (client_t *self, const char *filename)
+{
+    zfile_t *file = (zfile_t *) zhash_lookup (self->files, filename);
+    if (file)
+        zfile_remove (file);
+    zhash_delete (self->files, filename);
+    zhash_delete (self->streams, filename);
+    zhash_delete (self->broken, filename);
+    zhash_delete (self->digests, filename);
+    zhash_delete (self->copied, filename);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Save the journal position the server last gave us, once we hold every
+//  file whole. The position says we hold all the server has, so it must
+//  wait for the writer, and for any file we asked the server to resend;
+//  if we saved it before, a client that reconnects would catch up past
+//  that file and never get it.
+
+static void
+client_journal_advance (client_t *self)
+{
+    if (!self->journal_due)
+        return;
+    client_writer_sync (self);
+    if (zhash_size (self->broken) == 0 && zhash_size (self->resent) == 0) {
+        client_journal_save (self, self->journal_due);
+        zstr_free (&self->journal_due);
+    }
 }
 
 
@@ -209,59 +1183,274 @@ process_the_patch (client_t *self)
         zsys_error ("filename did not start with a \'/\'");
         return;
     }
-
-    sub_t *subscr = (sub_t *) zlist_first (self->subs);
-    while (subscr) {
-        if (!strncmp (filename, subscr->path, strlen (subscr->path))) {
-            filename += strlen (subscr->path);
-            zsys_debug ("subscription found for %s", filename);
-            break;
+    sub_t *owner = client_inbox_sub (self, filename);
+    filename = client_inbox_name (self, filename);
+    if (fmq_msg_operation (self->message) != FMQ_MSG_FILE_DELETE)
+        client_name_claim (self, owner, filename);
+
+    //  Chunks go to the writer; before anything else we let the writer
+    //  catch up, so we never touch a file it's still writing
+    zhash_t *headers = fmq_msg_headers (self->message);
+    if (fmq_msg_operation (self->message) != FMQ_MSG_FILE_CREATE
+    ||  (headers && zhash_lookup (headers, "RESTART"))
+    ||  (fmq_msg_chunk_size (self->message) == 0
+    &&   !(headers && zhash_lookup (headers, "BLOCK"))))
+        client_writer_sync (self);
+
+    if (fmq_msg_operation (self->message) == FMQ_MSG_FILE_CREATE
+    &&  client_copy_content (self, filename)) {
+        //  We copied this file from content we hold, so skip the chunks
+        //  the server sent before it heard, down to the end of the file.
+        //  These still cost credit, as references to blocks we hold do.
+        if (!fmq_msg_eof (self->message))
+            self->credit -= client_chunk_cost (self);
+        else {
+            zsys_debug ("file complete %s/%s", self->inbox, filename);
+            zhash_delete (self->copied, filename);
+            client_apply_headers (self, filename);
+            const char *digest =
+                (const char *) zhash_lookup (self->digests, filename);
+            zsock_send (self->msgpipe, "ssss", "FILE UPDATED", self->inbox,
+                filename, digest? digest: "");
+            zhash_delete (self->digests, filename);
         }
     }
-    if ('/' == *filename) filename++;
-
+    else
     if (fmq_msg_operation (self->message) == FMQ_MSG_FILE_CREATE) {
-        if (self->file == NULL) {
-            zsys_debug ("creating file object for %s/%s", self->inbox,
+        //  The server may interleave small files with a bulk transfer,
+        //  so we keep each file we're writing until its last chunk. It
+        //  tells us the size of a large file, for us to reserve.
+        zfile_t *file = (zfile_t *) zhash_lookup (self->files, filename);
+        const char *reserve = headers?
+            (const char *) zhash_lookup (headers, "SIZE"): NULL;
+        if (file && headers && zhash_lookup (headers, "RESTART")) {
+            //  The server gave up on the version we were getting, and
+            //  sends the file afresh
+            zsys_debug ("restarting file %s/%s", self->inbox, filename);
+            zhash_delete (self->broken, filename);
+            if (s_file_truncate (file, 0)) {
+                zsys_warning ("unable to empty %s/%s", self->inbox, filename);
+                zhash_update (self->broken, filename, (void *) "");
+            }
+            if (reserve)
+                s_file_reserve (file, (off_t) atoll (reserve));
+            zhash_update (self->streams, filename, stream_new ());
+            zhash_freefn (self->streams, filename, s_stream_free);
+        }
+        else
+        if (file == NULL) {
+            zsys_debug ("creating file object for %s/%s", self->partial,
                 filename);
-            self->file = zfile_new (self->inbox, filename);
-            if (zfile_output (self->file)) {
-                zsys_warning ("unable to write to file %s/%s", self->inbox,
+            file = zfile_new (self->partial, filename);
+            if (zfile_output (file)) {
+                zsys_warning ("unable to write to file %s/%s", self->partial,
                     filename);
                 //  File not writeable, skip patch
-                zfile_destroy (&self->file);
+                zfile_destroy (&file);
                 return;
             }
+            //  The server skips holes in sparse files, so we must not keep
+            //  old data where they fall
+            if (s_file_truncate (file, 0) && zfile_cursize (file)) {
+                zsys_warning ("unable to empty %s/%s", self->partial, filename);
+                zhash_update (self->broken, filename, (void *) "");
+            }
+            if (reserve)
+                s_file_reserve (file, (off_t) atoll (reserve));
+            zhash_insert (self->files, filename, file);
+            zhash_freefn (self->files, filename, s_file_free);
+            zhash_update (self->streams, filename, stream_new ());
+            zhash_freefn (self->streams, filename, s_stream_free);
         }
-        //  Try to write, ignore errors in this version
-        zchunk_t *chunk = fmq_msg_chunk (self->message);
-        if (zchunk_size (chunk) > 0) {
+        //  We hand each chunk to the writer, and digest it once written.
+        //  A chunk may instead name a block we hold, which the writer
+        //  copies; that costs credit as a chunk of its size would.
+        off_t offset = (off_t) fmq_msg_offset (self->message);
+        size_t size = fmq_msg_chunk_size (self->message);
+        if (headers && zhash_lookup (headers, "BLOCK")) {
+            zsys_debug ("copying block at offset %u of %s/%s",
+                fmq_msg_offset (self->message), self->inbox, filename);
+            self->credit -= client_chunk_cost (self);
+            if (client_copy_block (self, filename, file, offset)) {
+                zsys_warning ("unable to copy block for %s/%s", self->inbox,
+                    filename);
+                zhash_update (self->broken, filename, (void *) "");
+            }
+        }
+        else
+        if (size > 0) {
             zsys_debug ("writing chunk at offset %u of %s/%s",
                 fmq_msg_offset (self->message), self->inbox, filename);
-            zfile_write (self->file, chunk, fmq_msg_offset (self->message));
-            self->credit -= zchunk_size (chunk);
+            if (client_write (self, filename, file, offset)) {
+                zsys_warning ("unable to write to file %s/%s", self->inbox,
+                    filename);
+                zhash_update (self->broken, filename, (void *) "");
+            }
+            self->credit -= size;
         }
         else {
-            //  Zero-sized chunk means end of file, so report back to caller
-            //  Communicate back to caller via the msgpipe
+            //  Zero-sized chunk means end of file, at the offset given.
+            //  We move the file into the inbox and report back to caller
+            //  via the msgpipe.
             zsys_debug ("file complete %s/%s", self->inbox, filename);
-            zsock_send (self->msgpipe, "sss", "FILE UPDATED", self->inbox,
-                filename);
-            zfile_destroy (&self->file);
+            if (s_file_truncate (file, (off_t) fmq_msg_offset (self->message))) {
+                zsys_warning ("unable to set size of %s/%s", self->partial,
+                    filename);
+                zhash_update (self->broken, filename, (void *) "");
+            }
+            zhash_delete (self->files, filename);
+
+            //  The server's digest of the file checks what we wrote, end
+            //  to end. We digested each chunk as we wrote it, and read
+            //  the file back only if we lost track of what we wrote.
+            const char *digest = headers?
+                (const char *) zhash_lookup (headers, "DIGEST"): NULL;
+            stream_t *stream =
+                (stream_t *) zhash_lookup (self->streams, filename);
+            const char *written = stream_finish (stream,
+                (off_t) fmq_msg_offset (self->message));
+            zfile_t *check = NULL;
+            if (digest && !written && !zhash_lookup (self->broken, filename)) {
+                check = zfile_new (self->partial, filename);
+                written = zfile_digest (check);
+            }
+            if (digest && !zhash_lookup (self->broken, filename)
+            &&  (!written || strneq (written, digest))) {
+                zsys_warning ("digest mismatch on %s/%s", self->partial,
+                    filename);
+                zhash_update (self->broken, filename, (void *) "");
+            }
+            if (!digest)
+                digest = (const char *) zhash_lookup (self->digests, filename);
+            if (!digest)
+                digest = written;
+            char *content = digest? strdup (digest): NULL;
+            zfile_destroy (&check);
+
+            if (zhash_lookup (self->broken, filename)) {
+                //  Rather the version we had than a wrong one; we ask
+                //  the server for the file again
+                zsys_warning ("dropping incomplete file %s/%s", self->partial,
+                    filename);
+                char *path = zsys_sprintf ("%s/%s", self->partial, filename);
+                zsys_file_delete (path);
+                free (path);
+                client_ask_resend (self, filename);
+            }
+            else
+            if (client_file_commit (self, filename) == 0) {
+                client_apply_headers (self, filename);
+                zsock_send (self->msgpipe, "ssss", "FILE UPDATED", self->inbox,
+                    filename, content? content: "");
+                if (content)
+                    zhash_update (self->contents, content, (void *) filename);
+                zhash_delete (self->resent, filename);
+            }
+            else
+                client_ask_resend (self, filename);
+            free (content);
+            zhash_delete (self->broken, filename);
+            zhash_delete (self->streams, filename);
+            zhash_delete (self->digests, filename);
         }
     }
     else
+    if (fmq_msg_operation (self->message) == FMQ_MSG_FILE_DELETE
+    &&  client_name_elsewhere (self, owner, filename))
+        //  Another subscription gave us the file we hold at that name
+        zsys_debug ("keeping %s/%s for another subscription", self->inbox,
+            filename);
+    else
     if (fmq_msg_operation (self->message) == FMQ_MSG_FILE_DELETE) {
         zsys_debug ("delete %s/%s", self->inbox, filename);
+        if (owner)
+            zhash_delete (owner->names, filename);
+        //  Drop any partial file, the server won't finish sending it
+        client_file_drop (self, filename);
         zfile_t *file = zfile_new (self->inbox, filename);
         zfile_remove (file);
         zfile_destroy (&file);
 
-        //  Report file deletion back to caller
-        //  Notify the caller of deletion
-        zsock_send (self->msgpipe, "sss", "FILE DELETED", self->inbox,
-            filename);
+        //  Report file deletion back to caller; there is no digest, but
+        //  we send the same frames as for an update
+        zsock_send (self->msgpipe, "ssss", "FILE DELETED", self->inbox,
+            filename, "");
     }
+    else
+    if (fmq_msg_operation (self->message) == FMQ_MSG_FILE_MOVE) {
+        //  The server moved a file we hold; we rename our copy rather
+        //  than fetch it again
+        const char *from = headers?
+            (const char *) zhash_lookup (headers, "FROM"): NULL;
+        client_file_drop (self, filename);
+        if (from && *from == '/') {
+            from = client_inbox_name (self, from);
+            zsys_debug ("move %s/%s to %s/%s", self->inbox, from,
+                self->inbox, filename);
+            char *source = zsys_sprintf ("%s/%s", self->inbox, from);
+            char *target = zsys_sprintf ("%s/%s", self->inbox, filename);
+            char *slash = strrchr (target, '/');
+            *slash = 0;
+            zsys_dir_create ("%s", target);
+            *slash = '/';
+            if (rename (source, target) == 0) {
+                client_name_claim (self, NULL, from);
+                zsock_send (self->msgpipe, "ssss", "FILE DELETED", self->inbox,
+                    from, "");
+                zsock_send (self->msgpipe, "ssss", "FILE UPDATED", self->inbox,
+                    filename, "");
+            }
+            else
+                zsys_warning ("unable to move %s to %s", source, target);
+            free (source);
+            free (target);
+        }
+        else
+            zsys_error ("file move has no valid FROM header");
+    }
+    else
+    if (fmq_msg_operation (self->message) == FMQ_MSG_FILE_COPY) {
+        //  We hold the content under another path, so we copy that
+        const char *from = headers?
+            (const char *) zhash_lookup (headers, "FROM"): NULL;
+        const char *digest = headers?
+            (const char *) zhash_lookup (headers, "DIGEST"): NULL;
+        client_file_drop (self, filename);
+        if (from && *from == '/' && digest) {
+            from = client_inbox_name (self, from);
+            zsys_debug ("copy %s/%s to %s/%s", self->inbox, from,
+                self->inbox, filename);
+            if (client_copy_file (self, from, filename, digest) == 0) {
+                client_apply_headers (self, filename);
+                zsock_send (self->msgpipe, "ssss", "FILE UPDATED", self->inbox,
+                    filename, digest);
+            }
+            else {
+                //  We keep what we held, and ask the server for the file
+                zsys_warning ("unable to copy %s/%s to %s/%s", self->inbox,
+                    from, self->inbox, filename);
+                client_ask_resend (self, filename);
+            }
+        }
+        else
+            zsys_error ("file copy has no valid FROM or DIGEST header");
+    }
+    else
+    if (fmq_msg_operation (self->message) == FMQ_MSG_FILE_ATTR) {
+        //  Only the file's properties changed, we hold its content
+        zsys_debug ("properties changed for %s/%s", self->inbox, filename);
+        client_apply_headers (self, filename);
+        zsock_send (self->msgpipe, "ssss", "FILE UPDATED", self->inbox,
+            filename, "");
+    }
+    //  The server tells us our journal position once we've caught up
+    const char *position = headers?
+        (const char *) zhash_lookup (headers, "JOURNAL"): NULL;
+    if (position) {
+        free (self->journal_due);
+        self->journal_due = strdup (position);
+    }
+    client_journal_advance (self);
 }
 
 
@@ -273,11 +1462,7 @@ static void
 refill_credit_as_needed (client_t *self)
 {
     zsys_debug ("refill credit as needed");
-    size_t credit_to_send = 0;
-    while (self->credit < CREDIT_MINIMUM) {
-        credit_to_send += CREDIT_SLICE;
-        self->credit += CREDIT_SLICE;
-    }
+    size_t credit_to_send = client_credit_due (self);
     if (credit_to_send) {
         fmq_msg_set_credit (self->message, credit_to_send);
         engine_set_next_event (self, send_credit_event);
@@ -329,6 +1514,8 @@ setup_inbox (client_t *self)
 {
     if (!self->inbox) {
         self->inbox = strdup (self->args->path);
+        self->partial = s_inbox_sibling (self, PARTIAL_SUFFIX);
+        client_journal_load (self);
         zsock_send (self->cmdpipe, "si", "SUCCESS", 0);
     }
     else
@@ -344,11 +1531,7 @@ static void
 signal_subscribe_success (client_t *self)
 {
     zsock_send (self->cmdpipe, "si", "SUCCESS", 0);
-    size_t credit_to_send = 0;
-    while (self->credit < CREDIT_MINIMUM) {
-        credit_to_send += CREDIT_SLICE;
-        self->credit += CREDIT_SLICE;
-    }
+    size_t credit_to_send = client_credit_due (self);
     if (credit_to_send) {
         fmq_msg_set_credit (self->message, credit_to_send);
         engine_set_next_event (self, send_credit_event);
@@ -545,27 +1728,52 @@ fmq_client_test (bool verbose)
     assert (sdigest);
     zsys_info ("fmq_client_test: Server file digest %s", sdigest);
 
-    //  Wait for notification of file update
+    //  Wait for notification of file update, which carries the digest
+    //  of the file we received, so we needn't read it back
     zmsg_t *pipemsg = zmsg_recv ( (void *) pipe);
     zmsg_print (pipemsg);
-    zmsg_destroy (&pipemsg);
-
-    //  See if the server and client files match
-    zfile_t *cfile = zfile_new ("./fmqclient", "test_file.txt");
-    assert (cfile);
-    zfile_restat (cfile);
-    char *cdigest = zfile_digest (cfile);
+    char *command = zmsg_popstr (pipemsg);
+    assert (streq (command, "FILE UPDATED"));
+    free (command);
+    char *inbox = zmsg_popstr (pipemsg);
+    free (inbox);
+    char *filename = zmsg_popstr (pipemsg);
+    assert (streq (filename, "test_file.txt"));
+    free (filename);
+    char *cdigest = zmsg_popstr (pipemsg);
     assert (cdigest);
     zsys_info ("fmq_client_test: Client file digest %s", cdigest);
+
+    //  See if the server and client files match, by the digest we were
+    //  told and by the file we actually hold
     assert (streq (sdigest, cdigest));
+    zfile_t *cfile = zfile_new ("./fmqclient", "test_file.txt");
+    assert (zfile_digest (cfile));
+    assert (streq (zfile_digest (cfile), sdigest));
+    zfile_destroy (&cfile);
+    free (cdigest);
+    zmsg_destroy (&pipemsg);
 
     //  Delete the file the server is sharing
     zfile_remove (sfile);
     zfile_destroy (&sfile);
 
-    //  Wait for notification of file update
+    //  Wait for notification of file deletion, which has the same frames
+    //  as an update, with an empty digest
     pipemsg = zmsg_recv ( (void *) pipe);
     zmsg_print (pipemsg);
+    assert (zmsg_size (pipemsg) == 4);
+    command = zmsg_popstr (pipemsg);
+    assert (streq (command, "FILE DELETED"));
+    free (command);
+    inbox = zmsg_popstr (pipemsg);
+    free (inbox);
+    filename = zmsg_popstr (pipemsg);
+    assert (streq (filename, "test_file.txt"));
+    free (filename);
+    cdigest = zmsg_popstr (pipemsg);
+    assert (streq (cdigest, ""));
+    free (cdigest);
     zmsg_destroy (&pipemsg);
 
     //  Kill the client
@@ -576,7 +1784,8 @@ fmq_client_test (bool verbose)
     zactor_destroy (&server);
     zsys_debug ("fmq_client_test: server destroyed");
 
-    //  Delete the file the client has
+    //  Delete the file the client has, if any
+    cfile = zfile_new ("./fmqclient", "test_file.txt");
     zfile_remove (cfile);
     zfile_destroy (&cfile);
 
@@ -587,6 +1796,12 @@ fmq_client_test (bool verbose)
     else
         zsys_error ("./fmqserver was not deleted");
 
+    //  Delete the directory the client wrote files in until complete
+    zdir_t *partial = zdir_new ("./fmqclient.partial", NULL);
+    if (partial)
+        zdir_remove (partial, true);
+    zdir_destroy (&partial);
+
     //  Delete the directory used by the client
     rc = zsys_dir_delete ("./fmqclient");
     if (rc == 0)
@@ -594,6 +1809,116 @@ fmq_client_test (bool verbose)
     else
         zsys_error ("./fmqclient was not deleted");
 
+    //  A client that drops the connection while it waits for a file the
+    //  server must resend doesn't save a journal position past that file,
+    //  so it gets the file when it comes back. A directory where the file
+    //  goes in the inbox makes every attempt to take it fail its check.
+    server = zactor_new (fmq_server, "fmq_server");
+    if (verbose)
+        zstr_send (server, "VERBOSE");
+    zstr_sendx (server, "SET", "server/journal", "./fmqjournal", NULL);
+    zstr_sendx (server, "BIND", "ipc://@/filemq-journal", NULL);
+    rc = zsys_dir_create ("./fmqserver");
+    assert (rc == 0);
+    rc = zsys_dir_create ("./fmqclient/held.txt");
+    assert (rc == 0);
+
+    sfile = zfile_new ("./fmqserver", "held.txt");
+    rc = zfile_output (sfile);
+    assert (rc == 0);
+    chunk = zchunk_new ((const void *) data, strlen (data));
+    rc = zfile_write (sfile, chunk, 0);
+    assert (rc == 0);
+    zchunk_destroy (&chunk);
+    zfile_destroy (&sfile);
+
+    zstr_sendx (server, "PUBLISH", "./fmqserver", "/", NULL);
+    response = zstr_recv (server);
+    assert (streq (response, "SUCCESS"));
+    zstr_free (&response);
+
+    client = fmq_client_new ("ipc://@/filemq-journal", 5000);
+    assert (client);
+    if (verbose)
+        fmq_client_verbose (client);
+    rc = fmq_client_set_inbox (client, "./fmqclient");
+    assert (rc >= 0);
+    rc = fmq_client_subscribe (client, "/");
+    assert (rc >= 0);
+    pipe = fmq_client_msgpipe (client);
+    zsock_set_rcvtimeo (pipe, 10000);
+
+    //  A file that changes later comes with the journal position, once
+    //  the client has failed to take the first file
+    sfile = zfile_new ("./fmqserver", "later.txt");
+    rc = zfile_output (sfile);
+    assert (rc == 0);
+    chunk = zchunk_new ((const void *) data, strlen (data));
+    rc = zfile_write (sfile, chunk, 0);
+    assert (rc == 0);
+    zchunk_destroy (&chunk);
+    zfile_destroy (&sfile);
+
+    filename = NULL;
+    while (!filename || strneq (filename, "later.txt")) {
+        zstr_free (&filename);
+        pipemsg = zmsg_recv ((void *) pipe);
+        assert (pipemsg);
+        command = zmsg_popstr (pipemsg);
+        assert (streq (command, "FILE UPDATED"));
+        free (command);
+        inbox = zmsg_popstr (pipemsg);
+        free (inbox);
+        filename = zmsg_popstr (pipemsg);
+        assert (strneq (filename, "held.txt"));
+        zmsg_destroy (&pipemsg);
+    }
+    zstr_free (&filename);
+
+    //  Drop the connection, clear the way, and come back
+    fmq_client_destroy (&client);
+    rc = zsys_dir_delete ("./fmqclient/held.txt");
+    assert (rc == 0);
+
+    client = fmq_client_new ("ipc://@/filemq-journal", 5000);
+    assert (client);
+    if (verbose)
+        fmq_client_verbose (client);
+    rc = fmq_client_set_inbox (client, "./fmqclient");
+    assert (rc >= 0);
+    rc = fmq_client_subscribe (client, "/");
+    assert (rc >= 0);
+    pipe = fmq_client_msgpipe (client);
+    zsock_set_rcvtimeo (pipe, 10000);
+
+    pipemsg = zmsg_recv ((void *) pipe);
+    assert (pipemsg);
+    command = zmsg_popstr (pipemsg);
+    assert (streq (command, "FILE UPDATED"));
+    free (command);
+    inbox = zmsg_popstr (pipemsg);
+    free (inbox);
+    filename = zmsg_popstr (pipemsg);
+    assert (streq (filename, "held.txt"));
+    free (filename);
+    zmsg_destroy (&pipemsg);
+
+    fmq_client_destroy (&client);
+    zactor_destroy (&server);
+
+    //  Delete the files and directories of this test
+    const char *paths [] = {
+        "./fmqserver", "./fmqclient", "./fmqclient.partial", "./fmqjournal"
+    };
+    size_t path_nbr;
+    for (path_nbr = 0; path_nbr < sizeof (paths) / sizeof (*paths); path_nbr++) {
+        zdir_t *dir = zdir_new (paths [path_nbr], NULL);
+        if (dir)
+            zdir_remove (dir, true);
+        zdir_destroy (&dir);
+    }
+    zsys_file_delete ("./fmqclient.journal");
+
     //  @end
     printf ("OK\n");
 }
@@ -0,0 +1,500 @@
+/*  =========================================================================
+    fmq_journal - durable journal of changes, in numbered segments
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.
+    This file is part of FileMQ, a C implemenation of the protocol:
+    https://github.com/danriegsecker/filemq2.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    Durable journal of changes, each with a sequence number one greater
+    than the last, so a peer that knows how far it got can be sent only
+    what changed since.
+@discuss
+    The journal is a directory of segment files, each named for the
+    sequence number of its first change, in hexadecimal, and an epoch file.
+    Each change is a record of the sequence number, 8 octets, the operation,
+    1 octet, and the length of the virtual path, 2 octets, all in network
+    order, followed by the virtual path. We only ever append to the newest
+    segment, and readers map older segments straight into memory.
+
+    Opening a journal always starts a new segment, so a record torn by a
+    crash is only ever at the end of a segment, where readers stop. If we
+    cannot write a change, we drop the journal and start a new epoch, so no
+    peer can skip a change we failed to record.
+@end
+*/
+
+#include "filemq_classes.h"
+#if defined (__UNIX__)
+#   include <sys/mman.h>
+#endif
+
+//  Size of the record header, before the virtual path
+#define RECORD_HEADER   11
+
+//  Structure of our class
+
+struct _fmq_journal_t {
+    char *path;                 //  Journal directory
+    char *epoch;                //  Journal epoch
+    size_t segment_size;        //  Start a new segment past this size
+    size_t segment_keep;        //  Keep at most this many segments
+    zlist_t *segments;          //  Segment filenames, oldest first
+    FILE *handle;               //  Segment we're appending to, if any
+    size_t written;             //  Bytes written to that segment
+    uint64_t sequence;          //  Last sequence number appended
+};
+
+
+//  --------------------------------------------------------------------------
+//  Return the sequence number of the first change in a segment, from its
+//  name
+
+static uint64_t
+s_segment_first (const char *filename)
+{
+    const char *name = strrchr (filename, '/');
+    return strtoull (name? name + 1: filename, NULL, 16);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Map a segment into memory for reading, returning NULL if it's empty or
+//  can't be read
+
+static byte *
+s_segment_map (const char *filename, size_t *size_p)
+{
+    byte *data = NULL;
+    *size_p = 0;
+#if defined (__UNIX__)
+    int handle = open (filename, O_RDONLY);
+    if (handle == -1)
+        return NULL;
+    struct stat stat_buf;
+    if (fstat (handle, &stat_buf) == 0 && stat_buf.st_size > 0) {
+        data = (byte *) mmap (NULL, (size_t) stat_buf.st_size,
+                              PROT_READ, MAP_PRIVATE, handle, 0);
+        if (data == (byte *) MAP_FAILED)
+            data = NULL;
+        else
+            *size_p = (size_t) stat_buf.st_size;
+    }
+    close (handle);
+#else
+    FILE *handle = fopen (filename, "rb");
+    if (!handle)
+        return NULL;
+    fseek (handle, 0, SEEK_END);
+    long size = ftell (handle);
+    if (size > 0) {
+        data = (byte *) malloc ((size_t) size);
+        fseek (handle, 0, SEEK_SET);
+        if (fread (data, 1, (size_t) size, handle) == (size_t) size)
+            *size_p = (size_t) size;
+        else {
+            free (data);
+            data = NULL;
+        }
+    }
+    fclose (handle);
+#endif
+    return data;
+}
+
+static void
+s_segment_unmap (byte *data, size_t size)
+{
+    if (data) {
+#if defined (__UNIX__)
+        munmap (data, size);
+#else
+        free (data);
+#endif
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Walk the records in a segment, calling handler, if any, for each change
+//  past after. We stop at a torn record, and when the handler asks us to,
+//  setting *stopped_p. Returns the sequence number of the last whole record,
+//  or 0 if there is none.
+
+static uint64_t
+s_segment_scan (const char *filename, uint64_t after,
+                fmq_journal_fn *handler, void *argument, bool *stopped_p)
+{
+    size_t size;
+    byte *data = s_segment_map (filename, &size);
+    char *vpath = handler? (char *) malloc (0x10000): NULL;
+    uint64_t last = 0;
+    size_t offset = 0;
+    while (offset + RECORD_HEADER <= size) {
+        byte *record = data + offset;
+        size_t length = ((size_t) record [9] << 8) + record [10];
+        if (offset + RECORD_HEADER + length > size)
+            break;              //  Torn record
+        uint64_t sequence = 0;
+        int index;
+        for (index = 0; index < 8; index++)
+            sequence = (sequence << 8) + record [index];
+        last = sequence;
+        offset += RECORD_HEADER + length;
+
+        if (handler && sequence > after) {
+            memcpy (vpath, record + RECORD_HEADER, length);
+            vpath [length] = 0;
+            if (handler (sequence, record [8], vpath, argument)) {
+                *stopped_p = true;
+                break;
+            }
+        }
+    }
+    free (vpath);
+    s_segment_unmap (data, size);
+    return last;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Start a new epoch, writing it to the epoch file
+
+static void
+s_journal_new_epoch (fmq_journal_t *self)
+{
+    char buffer [64];
+    snprintf (buffer, sizeof (buffer), "%llx%04x",
+              (unsigned long long) zclock_time (),
+              (unsigned) (zclock_usecs () & 0xFFFF));
+    free (self->epoch);
+    self->epoch = strdup (buffer);
+
+    char *filename = zsys_sprintf ("%s/epoch", self->path);
+    FILE *handle = fopen (filename, "w");
+    if (handle) {
+        fprintf (handle, "%s\n", self->epoch);
+        fclose (handle);
+    }
+    else
+        zsys_error ("journal: cannot write %s", filename);
+    free (filename);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Drop every segment and start a new epoch, after a failed write
+
+static void
+s_journal_reset (fmq_journal_t *self)
+{
+    zsys_error ("journal: cannot write to %s, starting a new epoch",
+                self->path);
+    if (self->handle) {
+        fclose (self->handle);
+        self->handle = NULL;
+    }
+    while (zlist_size (self->segments)) {
+        char *filename = (char *) zlist_pop (self->segments);
+        zsys_file_delete (filename);
+        free (filename);
+    }
+    s_journal_new_epoch (self);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Close the current segment and start a new one, dropping the oldest
+//  segments past segment_keep
+
+static void
+s_journal_roll (fmq_journal_t *self)
+{
+    if (self->handle)
+        fclose (self->handle);
+    char *filename = zsys_sprintf ("%s/%016llx.seg", self->path,
+                                   (unsigned long long) (self->sequence + 1));
+    self->handle = fopen (filename, "ab");
+    self->written = 0;
+    zlist_append (self->segments, filename);
+    free (filename);
+
+    while (zlist_size (self->segments) > self->segment_keep) {
+        char *oldest = (char *) zlist_pop (self->segments);
+        zsys_file_delete (oldest);
+        free (oldest);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Order segment filenames, for qsort
+
+static int
+s_name_compare (const void *item1, const void *item2)
+{
+    return strcmp (*(const char **) item1, *(const char **) item2);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Open the journal in the directory at path, creating it if needed. We
+//  start a new segment once the current one holds segment_size bytes, and
+//  keep at most segment_keep segments, dropping the oldest.
+
+fmq_journal_t *
+fmq_journal_new (const char *path, size_t segment_size, size_t segment_keep)
+{
+    if (zsys_dir_create ("%s", path)) {
+        zsys_error ("journal: cannot create %s", path);
+        return NULL;
+    }
+    fmq_journal_t *self = (fmq_journal_t *) zmalloc (sizeof (fmq_journal_t));
+    self->path = strdup (path);
+    self->segment_size = segment_size? segment_size: 1;
+    self->segment_keep = segment_keep? segment_keep: 1;
+    self->segments = zlist_new ();
+    zlist_autofree (self->segments);
+
+    char *filename = zsys_sprintf ("%s/epoch", path);
+    FILE *handle = fopen (filename, "r");
+    char buffer [64] = "";
+    if (handle) {
+        if (!fgets (buffer, sizeof (buffer), handle))
+            *buffer = 0;
+        buffer [strcspn (buffer, "\r\n")] = 0;
+        fclose (handle);
+    }
+    free (filename);
+    if (*buffer)
+        self->epoch = strdup (buffer);
+    else
+        s_journal_new_epoch (self);
+
+    //  Our segment names sort in sequence order
+    zdir_t *dir = zdir_new (path, NULL);
+    if (dir) {
+        zfile_t **files = zdir_flatten (dir);
+        size_t count = 0;
+        while (files [count])
+            count++;
+        const char **names = (const char **) malloc ((count + 1) * sizeof (char *));
+        size_t index, found = 0;
+        for (index = 0; index < count; index++) {
+            const char *name = zfile_filename (files [index], NULL);
+            size_t length = strlen (name);
+            if (length > 4 && streq (name + length - 4, ".seg"))
+                names [found++] = name;
+        }
+        qsort (names, found, sizeof (char *), s_name_compare);
+        for (index = 0; index < found; index++)
+            zlist_append (self->segments, (void *) names [index]);
+        free (names);
+        zdir_flatten_free (&files);
+        zdir_destroy (&dir);
+    }
+    //  Pick up where the newest segment leaves off
+    const char *newest = (const char *) zlist_last (self->segments);
+    if (newest) {
+        self->sequence = s_segment_scan (newest, 0, NULL, NULL, NULL);
+        if (self->sequence == 0)
+            self->sequence = s_segment_first (newest) - 1;
+    }
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Close the journal
+
+void
+fmq_journal_destroy (fmq_journal_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        fmq_journal_t *self = *self_p;
+        if (self->handle)
+            fclose (self->handle);
+        zlist_destroy (&self->segments);
+        free (self->epoch);
+        free (self->path);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the journal epoch
+
+const char *
+fmq_journal_epoch (fmq_journal_t *self)
+{
+    assert (self);
+    return self->epoch;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the sequence number of the last change appended, 0 if none
+
+uint64_t
+fmq_journal_sequence (fmq_journal_t *self)
+{
+    assert (self);
+    return self->sequence;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Append a change and return its sequence number
+
+uint64_t
+fmq_journal_append (fmq_journal_t *self, int operation, const char *vpath)
+{
+    assert (self);
+    if (!self->handle || self->written >= self->segment_size)
+        s_journal_roll (self);
+
+    size_t length = strlen (vpath);
+    assert (length <= 0xFFFF);
+    uint64_t sequence = self->sequence + 1;
+    byte header [RECORD_HEADER];
+    int index;
+    for (index = 0; index < 8; index++)
+        header [index] = (byte) (sequence >> (56 - 8 * index));
+    header [8] = (byte) operation;
+    header [9] = (byte) (length >> 8);
+    header [10] = (byte) (length & 0xFF);
+
+    if (self->handle
+    &&  fwrite (header, 1, RECORD_HEADER, self->handle) == RECORD_HEADER
+    &&  fwrite (vpath, 1, length, self->handle) == length)
+        self->written += RECORD_HEADER + length;
+    else
+        s_journal_reset (self);
+
+    self->sequence = sequence;
+    return sequence;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Write appended changes through to disk
+
+void
+fmq_journal_flush (fmq_journal_t *self)
+{
+    assert (self);
+    if (self->handle) {
+        if (fflush (self->handle))
+            s_journal_reset (self);
+#if defined (__UNIX__)
+        else
+            fsync (fileno (self->handle));
+#endif
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Call handler for each change after the given sequence number, oldest
+//  first. Returns 0 if OK, or -1 if the journal no longer holds all those
+//  changes, in which case the handler is not called at all.
+
+int
+fmq_journal_replay (fmq_journal_t *self, uint64_t after,
+                    fmq_journal_fn *handler, void *argument)
+{
+    assert (self);
+    const char *oldest = (const char *) zlist_first (self->segments);
+    uint64_t first = oldest? s_segment_first (oldest): self->sequence + 1;
+    if (after > self->sequence || after + 1 < first)
+        return -1;
+    if (self->handle)
+        fflush (self->handle);
+
+    //  Skip segments that end at or before the change after 'after'
+    zlist_t *segments = zlist_dup (self->segments);
+    bool stopped = false;
+    const char *segment = (const char *) zlist_first (segments);
+    while (segment && !stopped) {
+        const char *next = (const char *) zlist_next (segments);
+        if (!next || s_segment_first (next) > after + 1)
+            s_segment_scan (segment, after, handler, argument, &stopped);
+        segment = next;
+    }
+    zlist_destroy (&segments);
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Selftest
+
+static int
+s_test_count (uint64_t sequence, int operation, const char *vpath,
+              void *argument)
+{
+    assert (streq (vpath, "/photos/one"));
+    (*(int *) argument)++;
+    return 0;
+}
+
+void
+fmq_journal_test (bool verbose)
+{
+    printf (" * fmq_journal: ");
+
+    //  @selftest
+    //  Three records to a segment, and three segments kept
+    fmq_journal_t *journal = fmq_journal_new ("./fmqjournal", 64, 3);
+    assert (journal);
+    assert (fmq_journal_sequence (journal) == 0);
+    char *epoch = strdup (fmq_journal_epoch (journal));
+    uint64_t sequence;
+    for (sequence = 1; sequence <= 20; sequence++)
+        assert (fmq_journal_append (journal, 1, "/photos/one") == sequence);
+    fmq_journal_flush (journal);
+
+    //  Only changes 13 to 20 are still held
+    int count = 0;
+    assert (fmq_journal_replay (journal, 0, s_test_count, &count) == -1);
+    assert (fmq_journal_replay (journal, 11, s_test_count, &count) == -1);
+    assert (count == 0);
+    assert (fmq_journal_replay (journal, 12, s_test_count, &count) == 0);
+    assert (count == 8);
+    count = 0;
+    assert (fmq_journal_replay (journal, 17, s_test_count, &count) == 0);
+    assert (count == 3);
+    count = 0;
+    assert (fmq_journal_replay (journal, 20, s_test_count, &count) == 0);
+    assert (count == 0);
+    assert (fmq_journal_replay (journal, 21, s_test_count, &count) == -1);
+    fmq_journal_destroy (&journal);
+
+    //  Reopening picks up the sequence and epoch where we left off
+    journal = fmq_journal_new ("./fmqjournal", 64, 3);
+    assert (journal);
+    assert (fmq_journal_sequence (journal) == 20);
+    assert (streq (fmq_journal_epoch (journal), epoch));
+    assert (fmq_journal_append (journal, 2, "/photos/one") == 21);
+    assert (fmq_journal_replay (journal, 18, s_test_count, &count) == 0);
+    assert (count == 3);
+    fmq_journal_destroy (&journal);
+    free (epoch);
+
+    zdir_t *dir = zdir_new ("./fmqjournal", NULL);
+    zdir_remove (dir, true);
+    zdir_destroy (&dir);
+    //  @end
+
+    printf ("OK\n");
+}
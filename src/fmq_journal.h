@@ -0,0 +1,72 @@
+/*  =========================================================================
+    fmq_journal - durable journal of changes, in numbered segments
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.
+    This file is part of FileMQ, a C implemenation of the protocol:
+    https://github.com/danriegsecker/filemq2.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef __FMQ_JOURNAL_H_INCLUDED__
+#define __FMQ_JOURNAL_H_INCLUDED__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _fmq_journal_t fmq_journal_t;
+
+//  @interface
+//  Callback for each change we replay; return 0 to go on, or -1 to stop
+typedef int (fmq_journal_fn) (
+    uint64_t sequence, int operation, const char *vpath, void *argument);
+
+//  Open the journal in the directory at path, creating it if needed. We
+//  start a new segment once the current one holds segment_size bytes, and
+//  keep at most segment_keep segments, dropping the oldest.
+fmq_journal_t *
+    fmq_journal_new (const char *path, size_t segment_size, size_t segment_keep);
+
+//  Close the journal
+void
+    fmq_journal_destroy (fmq_journal_t **self_p);
+
+//  Return the journal epoch, which changes whenever the journal is created
+//  afresh, so sequence numbers from another journal are never mistaken
+//  for ours
+const char *
+    fmq_journal_epoch (fmq_journal_t *self);
+
+//  Return the sequence number of the last change appended, 0 if none
+uint64_t
+    fmq_journal_sequence (fmq_journal_t *self);
+
+//  Append a change and return its sequence number
+uint64_t
+    fmq_journal_append (fmq_journal_t *self, int operation, const char *vpath);
+
+//  Write appended changes through to disk
+void
+    fmq_journal_flush (fmq_journal_t *self);
+
+//  Call handler for each change after the given sequence number, oldest
+//  first. Returns 0 if OK, or -1 if the journal no longer holds all those
+//  changes, in which case the handler is not called at all.
+int
+    fmq_journal_replay (fmq_journal_t *self, uint64_t after,
+                        fmq_journal_fn *handler, void *argument);
+
+//  Self test of this class
+void
+    fmq_journal_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
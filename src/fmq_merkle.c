@@ -0,0 +1,445 @@
+/*  =========================================================================
+    fmq_merkle - Merkle hash tree over a directory snapshot
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.
+    This file is part of FileMQ, a C implemenation of the protocol:
+    https://github.com/danriegsecker/filemq2.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    Merkle hash tree over a directory snapshot, so two peers can compare
+    trees by exchanging a handful of digests.
+@discuss
+    Each file carries its SHA-1 content digest. Each directory carries the
+    SHA-1 over its children, taken in name order, each child contributing
+    its name and its digest, both null terminated. Subdirectory names end
+    in '/', so a file and a directory of the same name never collide. Two
+    directories with the same digest hold the same files, and a peer that
+    finds a root that differs descends only into children that differ.
+
+    Building a tree digests every file in the snapshot. A tree built with
+    the previous tree for the same directory digests only files whose size
+    or modification time has changed since.
+@end
+*/
+
+#include "filemq_classes.h"
+
+//  Structure of our class
+
+struct _fmq_merkle_t {
+    zhash_t *dirs;              //  Directories, by path from root
+    zhash_t *files;             //  Files, by path from root
+};
+
+//  Directory in the tree
+typedef struct {
+    char *path;                 //  Path from root, "" for root
+    size_t depth;               //  Number of components in path
+    char *digest;               //  Digest over children, once known
+    zhash_t *children;          //  Child digests, by name
+} s_dir_t;
+
+//  File in the tree
+typedef struct {
+    char *digest;               //  Content digest
+    off_t size;                 //  Size when digested
+    time_t modified;            //  Modification time when digested
+} s_file_t;
+
+
+//  --------------------------------------------------------------------------
+//  Callbacks when we remove entries from the dirs and files tables
+
+static void
+s_dir_free (void *argument)
+{
+    s_dir_t *dir = (s_dir_t *) argument;
+    zhash_destroy (&dir->children);
+    free (dir->digest);
+    free (dir->path);
+    free (dir);
+}
+
+static void
+s_file_free (void *argument)
+{
+    s_file_t *file = (s_file_t *) argument;
+    free (file->digest);
+    free (file);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return path in the form we key entries by: no leading "./" or '/', no
+//  trailing '/', and "" for the root. Caller must free the result.
+
+static char *
+s_path_normal (const char *path)
+{
+    while (true) {
+        if (*path == '/')
+            path++;
+        else
+        if (path [0] == '.' && path [1] == '/')
+            path += 2;
+        else
+            break;
+    }
+    if (streq (path, "."))
+        path = "";
+    char *normal = strdup (path);
+    size_t length = strlen (normal);
+    while (length && normal [length - 1] == '/')
+        normal [--length] = 0;
+    return normal;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Split a normal path into its parent, which we return as a fresh string,
+//  and its last component, which we point name at
+
+static char *
+s_path_split (const char *path, const char **name_p)
+{
+    const char *slash = strrchr (path, '/');
+    size_t length = slash? (size_t) (slash - path): 0;
+    char *parent = (char *) malloc (length + 1);
+    memcpy (parent, path, length);
+    parent [length] = 0;
+    *name_p = slash? slash + 1: path;
+    return parent;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Look up the directory at path, creating it and any missing ancestors,
+//  each entered as a child of its parent
+
+static s_dir_t *
+s_merkle_dir (fmq_merkle_t *self, const char *path)
+{
+    s_dir_t *dir = (s_dir_t *) zhash_lookup (self->dirs, path);
+    if (dir)
+        return dir;
+
+    dir = (s_dir_t *) zmalloc (sizeof (s_dir_t));
+    dir->path = strdup (path);
+    dir->children = zhash_new ();
+    zhash_autofree (dir->children);
+    zhash_insert (self->dirs, path, dir);
+    zhash_freefn (self->dirs, path, s_dir_free);
+
+    if (*path) {
+        dir->depth = 1;
+        const char *scan = path;
+        while ((scan = strchr (scan, '/'))) {
+            dir->depth++;
+            scan++;
+        }
+        //  Digest is filled in once we've seen all children
+        const char *name;
+        char *parent = s_path_split (path, &name);
+        char *key = (char *) malloc (strlen (name) + 2);
+        sprintf (key, "%s/", name);
+        zhash_update (s_merkle_dir (self, parent)->children, key, (void *) "");
+        free (key);
+        free (parent);
+    }
+    return dir;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Order directories deepest first, for qsort
+
+static int
+s_dir_compare (const void *item1, const void *item2)
+{
+    const s_dir_t *dir1 = *(const s_dir_t **) item1;
+    const s_dir_t *dir2 = *(const s_dir_t **) item2;
+    return dir1->depth < dir2->depth? 1: dir1->depth > dir2->depth? -1: 0;
+}
+
+//  Order names, for qsort
+
+static int
+s_name_compare (const void *item1, const void *item2)
+{
+    return strcmp (*(const char **) item1, *(const char **) item2);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Calculate digest of a directory whose children are all known
+
+static void
+s_dir_digest (s_dir_t *self)
+{
+    zlist_t *keys = zhash_keys (self->children);
+    size_t count = zlist_size (keys);
+    const char **names = (const char **) malloc ((count + 1) * sizeof (char *));
+    size_t index = 0;
+    const char *name = (const char *) zlist_first (keys);
+    while (name) {
+        names [index++] = name;
+        name = (const char *) zlist_next (keys);
+    }
+    qsort (names, count, sizeof (char *), s_name_compare);
+
+    zdigest_t *digest = zdigest_new ();
+    for (index = 0; index < count; index++) {
+        const char *child = (const char *) zhash_lookup (self->children,
+                                                         names [index]);
+        zdigest_update (digest, (const byte *) names [index],
+                        strlen (names [index]) + 1);
+        zdigest_update (digest, (const byte *) child, strlen (child) + 1);
+    }
+    free (self->digest);
+    self->digest = strdup (zdigest_string (digest));
+    zdigest_destroy (&digest);
+    free (names);
+    zlist_destroy (&keys);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new Merkle tree over a directory snapshot, which may be NULL
+//  for an empty tree. If previous is not NULL, file digests are taken from
+//  it for files whose size and modification time have not changed.
+
+fmq_merkle_t *
+fmq_merkle_new (zdir_t *dir, fmq_merkle_t *previous)
+{
+    fmq_merkle_t *self = (fmq_merkle_t *) zmalloc (sizeof (fmq_merkle_t));
+    self->dirs = zhash_new ();
+    self->files = zhash_new ();
+    s_merkle_dir (self, "");
+
+    if (dir) {
+        zfile_t **files = zdir_flatten (dir);
+        uint index;
+        for (index = 0; files [index]; index++) {
+            zfile_t *file = files [index];
+            const char *path = zfile_filename (file, zdir_path (dir));
+            s_file_t *memo = previous?
+                (s_file_t *) zhash_lookup (previous->files, path): NULL;
+            const char *digest;
+            if (memo
+            &&  memo->size == zfile_cursize (file)
+            &&  memo->modified == zfile_modified (file))
+                digest = memo->digest;
+            else
+                digest = zfile_digest (file);
+            if (!digest)
+                continue;       //  Unreadable, so we can't offer it
+
+            s_file_t *entry = (s_file_t *) zmalloc (sizeof (s_file_t));
+            entry->digest = strdup (digest);
+            entry->size = zfile_cursize (file);
+            entry->modified = zfile_modified (file);
+            zhash_insert (self->files, path, entry);
+            zhash_freefn (self->files, path, s_file_free);
+
+            const char *name;
+            char *parent = s_path_split (path, &name);
+            zhash_update (s_merkle_dir (self, parent)->children,
+                          name, entry->digest);
+            free (parent);
+        }
+        zdir_flatten_free (&files);
+    }
+    //  Digest directories deepest first, so that each directory's
+    //  subdirectories are digested before it is
+    size_t count = zhash_size (self->dirs);
+    s_dir_t **dirs = (s_dir_t **) malloc (count * sizeof (s_dir_t *));
+    size_t index = 0;
+    s_dir_t *entry = (s_dir_t *) zhash_first (self->dirs);
+    while (entry) {
+        dirs [index++] = entry;
+        entry = (s_dir_t *) zhash_next (self->dirs);
+    }
+    qsort (dirs, count, sizeof (s_dir_t *), s_dir_compare);
+    for (index = 0; index < count; index++) {
+        s_dir_t *dir = dirs [index];
+        s_dir_digest (dir);
+        if (*dir->path) {
+            const char *name;
+            char *parent = s_path_split (dir->path, &name);
+            char *key = (char *) malloc (strlen (name) + 2);
+            sprintf (key, "%s/", name);
+            s_dir_t *up = (s_dir_t *) zhash_lookup (self->dirs, parent);
+            zhash_update (up->children, key, dir->digest);
+            free (key);
+            free (parent);
+        }
+    }
+    free (dirs);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy a Merkle tree
+
+void
+fmq_merkle_destroy (fmq_merkle_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        fmq_merkle_t *self = *self_p;
+        zhash_destroy (&self->dirs);
+        zhash_destroy (&self->files);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the digest of the file or directory at path, relative to the
+//  snapshot root; "", "." and "./" all name the root. Returns NULL if the
+//  tree holds nothing at path.
+
+const char *
+fmq_merkle_digest (fmq_merkle_t *self, const char *path)
+{
+    assert (self);
+    char *normal = s_path_normal (path);
+    const char *digest = NULL;
+    s_dir_t *dir = (s_dir_t *) zhash_lookup (self->dirs, normal);
+    if (dir)
+        digest = dir->digest;
+    else {
+        s_file_t *file = (s_file_t *) zhash_lookup (self->files, normal);
+        if (file)
+            digest = file->digest;
+    }
+    free (normal);
+    return digest;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the children of the directory at path, as digests keyed by
+//  name; names of subdirectories end in '/'. Returns NULL if path is not
+//  a directory in the tree. The hash belongs to the tree.
+
+zhash_t *
+fmq_merkle_children (fmq_merkle_t *self, const char *path)
+{
+    assert (self);
+    char *normal = s_path_normal (path);
+    s_dir_t *dir = (s_dir_t *) zhash_lookup (self->dirs, normal);
+    free (normal);
+    return dir? dir->children: NULL;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the paths of all files in the tree, relative to the snapshot
+//  root. The caller owns the list and must destroy it.
+
+zlist_t *
+fmq_merkle_files (fmq_merkle_t *self)
+{
+    assert (self);
+    return zhash_keys (self->files);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Selftest
+
+static void
+s_test_write (const char *path, const char *name, const char *data)
+{
+    zfile_t *file = zfile_new (path, name);
+    assert (file);
+    int rc = zfile_output (file);
+    assert (rc == 0);
+    zchunk_t *chunk = zchunk_new ((const void *) data, strlen (data));
+    rc = zfile_write (file, chunk, 0);
+    assert (rc == 0);
+    zchunk_destroy (&chunk);
+    zfile_close (file);
+    zfile_destroy (&file);
+}
+
+void
+fmq_merkle_test (bool verbose)
+{
+    printf (" * fmq_merkle: ");
+
+    //  @selftest
+    s_test_write ("./fmqmerkle", "a/one", "one\n");
+    s_test_write ("./fmqmerkle", "a/two", "two\n");
+    s_test_write ("./fmqmerkle", "b/three", "three\n");
+
+    zdir_t *dir = zdir_new ("./fmqmerkle", NULL);
+    assert (dir);
+    fmq_merkle_t *merkle = fmq_merkle_new (dir, NULL);
+    assert (merkle);
+    zdir_destroy (&dir);
+
+    //  Root lists both subdirectories, with their digests
+    const char *root = fmq_merkle_digest (merkle, "");
+    assert (root);
+    assert (streq (root, fmq_merkle_digest (merkle, "./")));
+    zhash_t *children = fmq_merkle_children (merkle, ".");
+    assert (children);
+    assert (zhash_size (children) == 2);
+    const char *digest_a = (const char *) zhash_lookup (children, "a/");
+    assert (digest_a);
+    assert (streq (digest_a, fmq_merkle_digest (merkle, "a")));
+    assert (streq (digest_a, fmq_merkle_digest (merkle, "/a/")));
+    assert (fmq_merkle_children (merkle, "a/one") == NULL);
+    assert (fmq_merkle_digest (merkle, "a/one"));
+    assert (fmq_merkle_digest (merkle, "a/four") == NULL);
+    zlist_t *files = fmq_merkle_files (merkle);
+    assert (zlist_size (files) == 3);
+    zlist_destroy (&files);
+
+    //  A rebuild from the previous tree gives the same digests
+    dir = zdir_new ("./fmqmerkle", NULL);
+    fmq_merkle_t *rebuilt = fmq_merkle_new (dir, merkle);
+    zdir_destroy (&dir);
+    assert (streq (root, fmq_merkle_digest (rebuilt, "")));
+    fmq_merkle_destroy (&rebuilt);
+
+    //  A change shows in its directory and the root, not elsewhere
+    s_test_write ("./fmqmerkle", "b/three", "three, again\n");
+    dir = zdir_new ("./fmqmerkle", NULL);
+    rebuilt = fmq_merkle_new (dir, merkle);
+    zdir_destroy (&dir);
+    assert (strneq (root, fmq_merkle_digest (rebuilt, "")));
+    assert (streq (fmq_merkle_digest (merkle, "a"),
+                   fmq_merkle_digest (rebuilt, "a")));
+    assert (strneq (fmq_merkle_digest (merkle, "b"),
+                    fmq_merkle_digest (rebuilt, "b")));
+    fmq_merkle_destroy (&rebuilt);
+
+    //  An empty tree still has a root
+    fmq_merkle_t *empty = fmq_merkle_new (NULL, NULL);
+    assert (fmq_merkle_digest (empty, ""));
+    assert (zhash_size (fmq_merkle_children (empty, "")) == 0);
+    fmq_merkle_destroy (&empty);
+
+    fmq_merkle_destroy (&merkle);
+    zsys_file_delete ("./fmqmerkle/a/one");
+    zsys_file_delete ("./fmqmerkle/a/two");
+    zsys_file_delete ("./fmqmerkle/b/three");
+    zsys_dir_delete ("./fmqmerkle/a");
+    zsys_dir_delete ("./fmqmerkle/b");
+    zsys_dir_delete ("./fmqmerkle");
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,60 @@
+/*  =========================================================================
+    fmq_merkle - Merkle hash tree over a directory snapshot
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.
+    This file is part of FileMQ, a C implemenation of the protocol:
+    https://github.com/danriegsecker/filemq2.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef __FMQ_MERKLE_H_INCLUDED__
+#define __FMQ_MERKLE_H_INCLUDED__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _fmq_merkle_t fmq_merkle_t;
+
+//  @interface
+//  Create a new Merkle tree over a directory snapshot, which may be NULL
+//  for an empty tree. If previous is not NULL, file digests are taken from
+//  it for files whose size and modification time have not changed.
+fmq_merkle_t *
+    fmq_merkle_new (zdir_t *dir, fmq_merkle_t *previous);
+
+//  Destroy a Merkle tree
+void
+    fmq_merkle_destroy (fmq_merkle_t **self_p);
+
+//  Return the digest of the file or directory at path, relative to the
+//  snapshot root; "", "." and "./" all name the root. Returns NULL if the
+//  tree holds nothing at path.
+const char *
+    fmq_merkle_digest (fmq_merkle_t *self, const char *path);
+
+//  Return the children of the directory at path, as digests keyed by
+//  name; names of subdirectories end in '/'. Returns NULL if path is not
+//  a directory in the tree. The hash belongs to the tree.
+zhash_t *
+    fmq_merkle_children (fmq_merkle_t *self, const char *path);
+
+//  Return the paths of all files in the tree, relative to the snapshot
+//  root. The caller owns the list and must destroy it.
+zlist_t *
+    fmq_merkle_files (fmq_merkle_t *self);
+
+//  Self test of this class
+void
+    fmq_merkle_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
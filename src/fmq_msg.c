@@ -3,14 +3,13 @@
 
     Codec class for fmq_msg.
 
-    ** WARNING *************************************************************
-    THIS SOURCE FILE IS 100% GENERATED. If you edit this file, you will lose
-    your changes at the next build cycle. This is great for temporary printf
-    statements. DO NOT MAKE ANY CHANGES YOU WISH TO KEEP. The correct places
-    for commits are:
-
-     * The XML model used for this code generation: fmq_msg.xml, or
-     * The code generation script that built this file: zproto_codec_c
+    ** NOTE ****************************************************************
+    This file was first generated from fmq_msg.xml by zproto_codec_c, and
+    is now maintained by hand, as the template does not decode chunks as
+    frame views, send them as trailing frames, or reuse storage between
+    messages. It is no longer part of 'make code'. When you change a
+    message in fmq_msg.xml, make the same change to fmq_msg.h and fmq_msg.c,
+    then set FMQ_MSG_MODEL to the new digest the selftest reports.
     ************************************************************************
     Copyright (c) the Contributors as noted in the AUTHORS file.       
     This file is part of FileMQ, a C implemenation of the protocol:    
@@ -31,6 +30,10 @@
 
 #include "../include/fmq_msg.h"
 
+//  SHA-1 digest of the fmq_msg.xml this codec implements; the selftest
+//  fails when the model no longer matches it
+#define FMQ_MSG_MODEL   "8E46D960C0715D0EAFB70704531F61F2B319ACE7"
+
 //  Structure of our class
 
 struct _fmq_msg_t {
@@ -45,14 +48,20 @@ struct _fmq_msg_t {
     size_t cache_bytes;                 //  Size of dictionary content
     uint64_t credit;                    //  Credit, in bytes
     uint64_t sequence;                  //  Chunk sequence, 0 and up
-    byte operation;                     //  Create=%d1 delete=%d2
+    byte operation;                     //  Create=%d1 delete=%d2 move=%d3 attr=%d4 copy=%d5
     char *filename;                     //  Relative name of file
     uint64_t offset;                    //  File offset in bytes
     byte eof;                           //  Last chunk in file?
     zhash_t *headers;                   //  File properties
     size_t headers_bytes;               //  Size of dictionary content
     zchunk_t *chunk;                    //  Data chunk
+    const byte *chunk_data;             //  Received chunk, view into frame
+    size_t chunk_size;                  //  Size of received chunk
+    zmq_msg_t frame;                    //  Last frame received, holds views
+    zmq_msg_t chunk_frame;              //  Chunk frame received or shared
+    bool chunk_trailing;                //  Chunk travels as trailing frame
     char reason [256];                  //  Printable explanation, 255 characters
+    char *value;                        //  Hash value being decoded
 };
 
 //  --------------------------------------------------------------------------
@@ -197,8 +206,7 @@ struct _fmq_msg_t {
         zsys_warning ("fmq_msg: GET_LONGSTR failed"); \
         goto malformed; \
     } \
-    free ((host)); \
-    (host) = (char *) malloc (string_size + 1); \
+    (host) = (char *) realloc ((host), string_size + 1); \
     memcpy ((host), self->needle, string_size); \
     (host) [string_size] = 0; \
     self->needle += string_size; \
@@ -212,6 +220,8 @@ fmq_msg_t *
 fmq_msg_new (void)
 {
     fmq_msg_t *self = (fmq_msg_t *) zmalloc (sizeof (fmq_msg_t));
+    zmq_msg_init (&self->frame);
+    zmq_msg_init (&self->chunk_frame);
     return self;
 }
 
@@ -234,6 +244,9 @@ fmq_msg_destroy (fmq_msg_t **self_p)
         free (self->filename);
         zhash_destroy (&self->headers);
         zchunk_destroy (&self->chunk);
+        zmq_msg_close (&self->frame);
+        zmq_msg_close (&self->chunk_frame);
+        free (self->value);
 
         //  Free object itself
         free (self);
@@ -242,6 +255,63 @@ fmq_msg_destroy (fmq_msg_t **self_p)
 }
 
 
+//  --------------------------------------------------------------------------
+//  Decode hash_size entries from the frame into the hash at *hash_p,
+//  reusing the hash the message kept from the last message, if any. Most
+//  messages of one kind carry the same keys, so an entry whose key the
+//  last message had keeps its node and key, and its value where the new
+//  one fits, and we allocate only for new keys and longer values. If the
+//  last message had keys this one lacks, we empty the hash and decode it
+//  again. Returns 0 if OK, -1 if the frame is malformed.
+
+static int
+s_hash_decode (fmq_msg_t *self, zhash_t **hash_p, size_t hash_size)
+{
+    if (!*hash_p) {
+        *hash_p = zhash_new ();
+        zhash_autofree (*hash_p);
+    }
+    zhash_t *hash = *hash_p;
+    byte *start = self->needle;
+    size_t held = zhash_size (hash);
+    size_t entry;
+    for (entry = 0; entry < hash_size; entry++) {
+        char key [256];
+        GET_STRING (key);
+        size_t value_size;
+        GET_NUMBER4 (value_size);
+        if (self->needle + value_size > self->ceiling) {
+            zsys_warning ("fmq_msg: hash value is missing data");
+            goto malformed;
+        }
+        char *value = (char *) zhash_lookup (hash, key);
+        if (value && strlen (value) >= value_size) {
+            memcpy (value, self->needle, value_size);
+            value [value_size] = 0;
+        }
+        else {
+            //  The hash copies the value, so we build it in our scratch
+            self->value = (char *) realloc (self->value, value_size + 1);
+            memcpy (self->value, self->needle, value_size);
+            self->value [value_size] = 0;
+            zhash_update (hash, key, self->value);
+        }
+        self->needle += value_size;
+    }
+    //  Keys are unique in a message, so any key left from the last one
+    //  makes the hash larger than this one
+    if (held && zhash_size (hash) != hash_size) {
+        zhash_purge (hash);
+        self->needle = start;
+        return s_hash_decode (self, hash_p, hash_size);
+    }
+    return 0;
+
+    malformed:
+        return -1;
+}
+
+
 //  --------------------------------------------------------------------------
 //  Receive a fmq_msg from the socket. Returns 0 if OK, -1 if
 //  there was an error. Blocks if there is no message waiting.
@@ -259,16 +329,23 @@ fmq_msg_recv (fmq_msg_t *self, zsock_t *input)
             return -1;          //  Interrupted or malformed
         }
     }
-    zmq_msg_t frame;
-    zmq_msg_init (&frame);
-    int size = zmq_msg_recv (&frame, zsock_resolve (input), 0);
+    //  We keep the frame until the next receive, so that the chunk can be
+    //  a view onto the received data rather than a copy of it
+    self->chunk_data = NULL;
+    self->chunk_size = 0;
+    self->chunk_trailing = false;
+    zmq_msg_close (&self->frame);
+    zmq_msg_init (&self->frame);
+    zmq_msg_close (&self->chunk_frame);
+    zmq_msg_init (&self->chunk_frame);
+    int size = zmq_msg_recv (&self->frame, zsock_resolve (input), 0);
     if (size == -1) {
         zsys_warning ("fmq_msg: interrupted");
         goto malformed;         //  Interrupted
     }
     //  Get and check protocol signature
-    self->needle = (byte *) zmq_msg_data (&frame);
-    self->ceiling = self->needle + zmq_msg_size (&frame);
+    self->needle = (byte *) zmq_msg_data (&self->frame);
+    self->ceiling = self->needle + zmq_msg_size (&self->frame);
     
     uint16_t signature;
     GET_NUMBER2 (signature);
@@ -309,32 +386,26 @@ fmq_msg_recv (fmq_msg_t *self, zsock_t *input)
             {
                 size_t hash_size;
                 GET_NUMBER4 (hash_size);
-                self->options = zhash_new ();
-                zhash_autofree (self->options);
-                while (hash_size--) {
-                    char key [256], *value = NULL;
-                    GET_STRING (key);
-                    GET_LONGSTR (value);
-                    zhash_insert (self->options, key, value);
-                    free (value);
-                }
+                if (s_hash_decode (self, &self->options, hash_size))
+                    goto malformed;
             }
             {
                 size_t hash_size;
                 GET_NUMBER4 (hash_size);
-                self->cache = zhash_new ();
-                zhash_autofree (self->cache);
-                while (hash_size--) {
-                    char key [256], *value = NULL;
-                    GET_STRING (key);
-                    GET_LONGSTR (value);
-                    zhash_insert (self->cache, key, value);
-                    free (value);
-                }
+                if (s_hash_decode (self, &self->cache, hash_size))
+                    goto malformed;
             }
             break;
 
         case FMQ_MSG_ICANHAZ_OK:
+            {
+                //  Older servers send no cache; treat that as empty
+                size_t hash_size = 0;
+                if (self->needle < self->ceiling)
+                    GET_NUMBER4 (hash_size);
+                if (s_hash_decode (self, &self->cache, hash_size))
+                    goto malformed;
+            }
             break;
 
         case FMQ_MSG_NOM:
@@ -351,15 +422,8 @@ fmq_msg_recv (fmq_msg_t *self, zsock_t *input)
             {
                 size_t hash_size;
                 GET_NUMBER4 (hash_size);
-                self->headers = zhash_new ();
-                zhash_autofree (self->headers);
-                while (hash_size--) {
-                    char key [256], *value = NULL;
-                    GET_STRING (key);
-                    GET_LONGSTR (value);
-                    zhash_insert (self->headers, key, value);
-                    free (value);
-                }
+                if (s_hash_decode (self, &self->headers, hash_size))
+                    goto malformed;
             }
             {
                 size_t chunk_size;
@@ -368,9 +432,22 @@ fmq_msg_recv (fmq_msg_t *self, zsock_t *input)
                     zsys_warning ("fmq_msg: chunk is missing data");
                     goto malformed;
                 }
-                self->chunk = zchunk_new (self->needle, chunk_size);
+                zchunk_destroy (&self->chunk);
+                self->chunk_data = self->needle;
+                self->chunk_size = chunk_size;
                 self->needle += chunk_size;
             }
+            //  A peer that negotiated trailing chunks sends the chunk as
+            //  a separate frame after the header frame
+            if (zsock_rcvmore (input)) {
+                if (zmq_msg_recv (&self->chunk_frame, zsock_resolve (input), 0) == -1) {
+                    zsys_warning ("fmq_msg: chunk frame is missing");
+                    goto malformed;
+                }
+                self->chunk_data = (byte *) zmq_msg_data (&self->chunk_frame);
+                self->chunk_size = zmq_msg_size (&self->chunk_frame);
+                self->chunk_trailing = true;
+            }
             break;
 
         case FMQ_MSG_HUGZ:
@@ -382,6 +459,16 @@ fmq_msg_recv (fmq_msg_t *self, zsock_t *input)
         case FMQ_MSG_KTHXBAI:
             break;
 
+        case FMQ_MSG_IHAZ:
+            GET_LONGSTR (self->filename);
+            {
+                size_t hash_size;
+                GET_NUMBER4 (hash_size);
+                if (s_hash_decode (self, &self->headers, hash_size))
+                    goto malformed;
+            }
+            break;
+
         case FMQ_MSG_SRSLY:
             GET_STRING (self->reason);
             break;
@@ -395,19 +482,35 @@ fmq_msg_recv (fmq_msg_t *self, zsock_t *input)
             goto malformed;
     }
     //  Successful return
-    zmq_msg_close (&frame);
     return 0;
 
     //  Error returns
     malformed:
         zsys_warning ("fmq_msg: fmq_msg malformed message, fail");
-        zmq_msg_close (&frame);
+        self->chunk_data = NULL;
+        self->chunk_size = 0;
+        zmq_msg_close (&self->frame);
+        zmq_msg_init (&self->frame);
+        zmq_msg_close (&self->chunk_frame);
+        zmq_msg_init (&self->chunk_frame);
         return -1;              //  Invalid message
 }
 
 
 //  --------------------------------------------------------------------------
-//  Send the fmq_msg to the socket. Does not destroy it. Returns 0 if
+//  Free a chunk once ZeroMQ has sent the frame built on its data
+
+static void
+s_chunk_free (void *data, void *hint)
+{
+    zchunk_t *chunk = (zchunk_t *) hint;
+    zchunk_destroy (&chunk);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Send the fmq_msg to the socket. Does not destroy it, except that a
+//  chunk sent as a trailing frame is passed to ZeroMQ and cleared. Returns 0 if
 //  OK, else -1.
 
 int
@@ -452,6 +555,19 @@ fmq_msg_send (fmq_msg_t *self, zsock_t *output)
             }
             frame_size += self->cache_bytes;
             break;
+        case FMQ_MSG_ICANHAZ_OK:
+            frame_size += 4;            //  Size is 4 octets
+            self->cache_bytes = 0;
+            if (self->cache) {
+                char *item = (char *) zhash_first (self->cache);
+                while (item) {
+                    self->cache_bytes += 1 + strlen (zhash_cursor (self->cache));
+                    self->cache_bytes += 4 + strlen (item);
+                    item = (char *) zhash_next (self->cache);
+                }
+            }
+            frame_size += self->cache_bytes;
+            break;
         case FMQ_MSG_NOM:
             frame_size += 8;            //  credit
             frame_size += 8;            //  sequence
@@ -476,8 +592,24 @@ fmq_msg_send (fmq_msg_t *self, zsock_t *output)
             }
             frame_size += self->headers_bytes;
             frame_size += 4;            //  Size is 4 octets
-            if (self->chunk)
-                frame_size += zchunk_size (self->chunk);
+            if (!self->chunk_trailing)
+                frame_size += fmq_msg_chunk_size (self);
+            break;
+        case FMQ_MSG_IHAZ:
+            frame_size += 4;
+            if (self->filename)
+                frame_size += strlen (self->filename);
+            frame_size += 4;            //  Size is 4 octets
+            if (self->headers) {
+                self->headers_bytes = 0;
+                char *item = (char *) zhash_first (self->headers);
+                while (item) {
+                    self->headers_bytes += 1 + strlen (zhash_cursor (self->headers));
+                    self->headers_bytes += 4 + strlen (item);
+                    item = (char *) zhash_next (self->headers);
+                }
+            }
+            frame_size += self->headers_bytes;
             break;
         case FMQ_MSG_SRSLY:
             frame_size += 1 + strlen (self->reason);
@@ -486,7 +618,10 @@ fmq_msg_send (fmq_msg_t *self, zsock_t *output)
             frame_size += 1 + strlen (self->reason);
             break;
     }
-    //  Now serialize message into the frame
+    //  Now serialize message into the frame. ZeroMQ keeps only the
+    //  smallest frames inline, and allocates the rest on the heap; we
+    //  can't keep one buffer for every message, as ZeroMQ may still be
+    //  sending the last one when we build the next.
     zmq_msg_t frame;
     zmq_msg_init_size (&frame, frame_size);
     self->needle = (byte *) zmq_msg_data (&frame);
@@ -530,6 +665,20 @@ fmq_msg_send (fmq_msg_t *self, zsock_t *output)
                 PUT_NUMBER4 (0);    //  Empty dictionary
             break;
 
+        case FMQ_MSG_ICANHAZ_OK:
+            if (self->cache) {
+                PUT_NUMBER4 (zhash_size (self->cache));
+                char *item = (char *) zhash_first (self->cache);
+                while (item) {
+                    PUT_STRING (zhash_cursor (self->cache));
+                    PUT_LONGSTR (item);
+                    item = (char *) zhash_next (self->cache);
+                }
+            }
+            else
+                PUT_NUMBER4 (0);    //  Empty dictionary
+            break;
+
         case FMQ_MSG_NOM:
             PUT_NUMBER8 (self->credit);
             PUT_NUMBER8 (self->sequence);
@@ -556,15 +705,38 @@ fmq_msg_send (fmq_msg_t *self, zsock_t *output)
             }
             else
                 PUT_NUMBER4 (0);    //  Empty dictionary
-            if (self->chunk) {
-                PUT_NUMBER4 (zchunk_size (self->chunk));
-                memcpy (self->needle,
-                        zchunk_data (self->chunk),
-                        zchunk_size (self->chunk));
-                self->needle += zchunk_size (self->chunk);
+            if (self->chunk_trailing) {
+                PUT_NUMBER4 (0);    //  Chunk follows in its own frame
+                nbr_frames++;
+            }
+            else {
+                PUT_NUMBER4 (fmq_msg_chunk_size (self));
+                if (fmq_msg_chunk_size (self)) {
+                    memcpy (self->needle,
+                            fmq_msg_chunk_data (self),
+                            fmq_msg_chunk_size (self));
+                    self->needle += fmq_msg_chunk_size (self);
+                }
+            }
+            break;
+
+        case FMQ_MSG_IHAZ:
+            if (self->filename) {
+                PUT_LONGSTR (self->filename);
             }
             else
-                PUT_NUMBER4 (0);    //  Empty chunk
+                PUT_NUMBER4 (0);    //  Empty string
+            if (self->headers) {
+                PUT_NUMBER4 (zhash_size (self->headers));
+                char *item = (char *) zhash_first (self->headers);
+                while (item) {
+                    PUT_STRING (zhash_cursor (self->headers));
+                    PUT_LONGSTR (item);
+                    item = (char *) zhash_next (self->headers);
+                }
+            }
+            else
+                PUT_NUMBER4 (0);    //  Empty dictionary
             break;
 
         case FMQ_MSG_SRSLY:
@@ -578,7 +750,31 @@ fmq_msg_send (fmq_msg_t *self, zsock_t *output)
     }
     //  Now send the data frame
     zmq_msg_send (&frame, zsock_resolve (output), --nbr_frames? ZMQ_SNDMORE: 0);
-    
+
+    //  Now send the trailing chunk frame, if any. We hand the chunk over
+    //  to ZeroMQ, which frees it once sent, so the data is not copied.
+    //  A chunk set as a shared frame goes as another reference to it.
+    if (self->id == FMQ_MSG_CHEEZBURGER && self->chunk_trailing) {
+        zmq_msg_t chunk_frame;
+        if (!self->chunk && self->chunk_size
+        &&  self->chunk_data == zmq_msg_data (&self->chunk_frame)) {
+            zmq_msg_init (&chunk_frame);
+            zmq_msg_move (&chunk_frame, &self->chunk_frame);
+            self->chunk_data = NULL;
+            self->chunk_size = 0;
+        }
+        else {
+            zchunk_t *chunk = fmq_msg_get_chunk (self);
+            if (chunk && zchunk_size (chunk))
+                zmq_msg_init_data (&chunk_frame, zchunk_data (chunk),
+                    zchunk_size (chunk), s_chunk_free, chunk);
+            else {
+                zmq_msg_init (&chunk_frame);
+                zchunk_destroy (&chunk);
+            }
+        }
+        zmq_msg_send (&chunk_frame, zsock_resolve (output), 0);
+    }
     return 0;
 }
 
@@ -631,6 +827,16 @@ fmq_msg_print (fmq_msg_t *self)
             
         case FMQ_MSG_ICANHAZ_OK:
             zsys_debug ("FMQ_MSG_ICANHAZ_OK:");
+            zsys_debug ("    cache=");
+            if (self->cache) {
+                char *item = (char *) zhash_first (self->cache);
+                while (item) {
+                    zsys_debug ("        %s=%s", zhash_cursor (self->cache), item);
+                    item = (char *) zhash_next (self->cache);
+                }
+            }
+            else
+                zsys_debug ("(NULL)");
             break;
             
         case FMQ_MSG_NOM:
@@ -674,6 +880,24 @@ fmq_msg_print (fmq_msg_t *self)
             zsys_debug ("FMQ_MSG_KTHXBAI:");
             break;
             
+        case FMQ_MSG_IHAZ:
+            zsys_debug ("FMQ_MSG_IHAZ:");
+            if (self->filename)
+                zsys_debug ("    filename='%s'", self->filename);
+            else
+                zsys_debug ("    filename=");
+            zsys_debug ("    headers=");
+            if (self->headers) {
+                char *item = (char *) zhash_first (self->headers);
+                while (item) {
+                    zsys_debug ("        %s=%s", zhash_cursor (self->headers), item);
+                    item = (char *) zhash_next (self->headers);
+                }
+            }
+            else
+                zsys_debug ("(NULL)");
+            break;
+            
         case FMQ_MSG_SRSLY:
             zsys_debug ("FMQ_MSG_SRSLY:");
             if (self->reason)
@@ -764,6 +988,9 @@ fmq_msg_command (fmq_msg_t *self)
         case FMQ_MSG_KTHXBAI:
             return ("KTHXBAI");
             break;
+        case FMQ_MSG_IHAZ:
+            return ("IHAZ");
+            break;
         case FMQ_MSG_SRSLY:
             return ("SRSLY");
             break;
@@ -1013,6 +1240,9 @@ zchunk_t *
 fmq_msg_chunk (fmq_msg_t *self)
 {
     assert (self);
+    //  A received chunk is only copied out of the frame on demand
+    if (!self->chunk && self->chunk_data)
+        self->chunk = zchunk_new (self->chunk_data, self->chunk_size);
     return self->chunk;
 }
 
@@ -1021,8 +1251,10 @@ fmq_msg_chunk (fmq_msg_t *self)
 zchunk_t *
 fmq_msg_get_chunk (fmq_msg_t *self)
 {
-    zchunk_t *chunk = self->chunk;
+    zchunk_t *chunk = fmq_msg_chunk (self);
     self->chunk = NULL;
+    self->chunk_data = NULL;
+    self->chunk_size = 0;
     return chunk;
 }
 
@@ -1035,9 +1267,107 @@ fmq_msg_set_chunk (fmq_msg_t *self, zchunk_t **chunk_p)
     assert (chunk_p);
     zchunk_destroy (&self->chunk);
     self->chunk = *chunk_p;
+    self->chunk_data = NULL;
+    self->chunk_size = 0;
+    zmq_msg_close (&self->chunk_frame);
+    zmq_msg_init (&self->chunk_frame);
     *chunk_p = NULL;
 }
 
+//  Set the chunk field to the data of a ZeroMQ frame, without copying it.
+//  The message takes another reference to the frame, so callers can share
+//  one frame between many messages; the caller keeps its own reference.
+
+void
+fmq_msg_set_chunk_frame (fmq_msg_t *self, zmq_msg_t *frame)
+{
+    assert (self);
+    assert (frame);
+    zchunk_destroy (&self->chunk);
+    zmq_msg_close (&self->chunk_frame);
+    zmq_msg_init (&self->chunk_frame);
+    zmq_msg_copy (&self->chunk_frame, frame);
+    self->chunk_data = (byte *) zmq_msg_data (&self->chunk_frame);
+    self->chunk_size = zmq_msg_size (&self->chunk_frame);
+}
+
+//  Get a reference to the frame that holds the chunk, and the offset of
+//  the chunk in that frame, without copying the data; frame must be an
+//  initialized frame, which the caller closes when done. The reference
+//  stays valid after the next receive. A chunk set with fmq_msg_set_chunk
+//  is not held in a frame, so we copy that one. Returns 0 if OK, -1 if
+//  the frame could not be made.
+
+int
+fmq_msg_chunk_frame (fmq_msg_t *self, zmq_msg_t *frame, size_t *offset_p)
+{
+    assert (self);
+    assert (frame);
+    assert (offset_p);
+    *offset_p = 0;
+    zmq_msg_close (frame);
+    if (self->chunk) {
+        size_t size = zchunk_size (self->chunk);
+        if (zmq_msg_init_size (frame, size))
+            return -1;
+        memcpy (zmq_msg_data (frame), zchunk_data (self->chunk), size);
+        return 0;
+    }
+    zmq_msg_init (frame);
+    if (!self->chunk_size)
+        return 0;
+    //  A received chunk is a view into its trailing frame, or into the
+    //  header frame; we share whichever holds it
+    zmq_msg_t *holder = &self->chunk_frame;
+    const byte *start = (byte *) zmq_msg_data (holder);
+    if (self->chunk_data < start
+    ||  self->chunk_data >= start + zmq_msg_size (holder)) {
+        holder = &self->frame;
+        start = (byte *) zmq_msg_data (holder);
+    }
+    if (zmq_msg_copy (frame, holder))
+        return -1;
+    *offset_p = self->chunk_data - start;
+    return 0;
+}
+
+//  Get the chunk data without copying it. For a received message this
+//  points into the received frame, and is valid until the next receive
+//  or until the message is destroyed.
+
+const byte *
+fmq_msg_chunk_data (fmq_msg_t *self)
+{
+    assert (self);
+    return self->chunk? zchunk_data (self->chunk): self->chunk_data;
+}
+
+//  Get the size of the chunk data, in bytes
+
+size_t
+fmq_msg_chunk_size (fmq_msg_t *self)
+{
+    assert (self);
+    return self->chunk? zchunk_size (self->chunk): self->chunk_size;
+}
+
+//  Get/set whether the chunk travels as a trailing frame. Only use this
+//  towards peers that asked for it, with the CHUNK-FRAME option.
+
+bool
+fmq_msg_chunk_trailing (fmq_msg_t *self)
+{
+    assert (self);
+    return self->chunk_trailing;
+}
+
+void
+fmq_msg_set_chunk_trailing (fmq_msg_t *self, bool chunk_trailing)
+{
+    assert (self);
+    self->chunk_trailing = chunk_trailing;
+}
+
 
 //  --------------------------------------------------------------------------
 //  Get/set the reason field
@@ -1070,6 +1400,14 @@ fmq_msg_test (bool verbose)
 {
     printf (" * fmq_msg: ");
 
+    //  Codec must implement the current model, when run from the source tree
+    zfile_t *model = zfile_new ("src", "fmq_msg.xml");
+    const char *digest = zfile_digest (model);
+    if (digest && strneq (digest, FMQ_MSG_MODEL))
+        zsys_error ("fmq_msg.xml (%s) has changed, update fmq_msg.c and fmq_msg.h", digest);
+    assert (!digest || streq (digest, FMQ_MSG_MODEL));
+    zfile_destroy (&model);
+
     //  @selftest
     //  Simple create/destroy test
     fmq_msg_t *self = fmq_msg_new ();
@@ -1122,6 +1460,9 @@ fmq_msg_test (bool verbose)
     }
     fmq_msg_set_id (self, FMQ_MSG_ICANHAZ_OK);
 
+    zhash_t *icanhaz_ok_cache = zhash_new ();
+    zhash_insert (icanhaz_ok_cache, "Name", "Brutus");
+    fmq_msg_set_cache (self, &icanhaz_ok_cache);
     //  Send twice
     fmq_msg_send (self, output);
     fmq_msg_send (self, output);
@@ -1129,6 +1470,7 @@ fmq_msg_test (bool verbose)
     for (instance = 0; instance < 2; instance++) {
         fmq_msg_recv (self, input);
         assert (fmq_msg_routing_id (self));
+        assert (zhash_size (fmq_msg_cache (self)) == 1);
     }
     fmq_msg_set_id (self, FMQ_MSG_NOM);
 
@@ -1165,8 +1507,54 @@ fmq_msg_test (bool verbose)
         assert (streq (fmq_msg_filename (self), "Life is short but Now lasts for ever"));
         assert (fmq_msg_offset (self) == 123);
         assert (fmq_msg_eof (self) == 123);
+        assert (fmq_msg_chunk_size (self) == 12);
+        assert (memcmp (fmq_msg_chunk_data (self), "Captcha Diem", 12) == 0);
         assert (memcmp (zchunk_data (fmq_msg_chunk (self)), "Captcha Diem", 12) == 0);
     }
+    //  Chunk can travel as a trailing frame, handed over to ZeroMQ
+    cheezburger_chunk = zchunk_new ("Captcha Diem", 12);
+    fmq_msg_set_chunk (self, &cheezburger_chunk);
+    fmq_msg_set_chunk_trailing (self, true);
+    fmq_msg_send (self, output);
+    assert (fmq_msg_chunk_size (self) == 0);
+    fmq_msg_set_chunk_trailing (self, false);
+    fmq_msg_recv (self, input);
+    assert (fmq_msg_chunk_trailing (self));
+    assert (fmq_msg_sequence (self) == 123);
+    assert (fmq_msg_chunk_size (self) == 12);
+    assert (memcmp (fmq_msg_chunk_data (self), "Captcha Diem", 12) == 0);
+
+    //  Chunk can be a frame shared with the caller, inline or trailing
+    zmq_msg_t shared_frame;
+    zmq_msg_init_size (&shared_frame, 12);
+    memcpy (zmq_msg_data (&shared_frame), "Captcha Diem", 12);
+    for (instance = 0; instance < 2; instance++) {
+        fmq_msg_set_chunk_frame (self, &shared_frame);
+        assert (fmq_msg_chunk_size (self) == 12);
+        fmq_msg_set_chunk_trailing (self, instance == 1);
+        fmq_msg_send (self, output);
+        fmq_msg_recv (self, input);
+        assert (fmq_msg_chunk_trailing (self) == (instance == 1));
+        assert (fmq_msg_chunk_size (self) == 12);
+        assert (memcmp (fmq_msg_chunk_data (self), "Captcha Diem", 12) == 0);
+
+        //  The chunk's frame outlives the next receive
+        zmq_msg_t chunk_frame;
+        zmq_msg_init (&chunk_frame);
+        size_t chunk_offset;
+        assert (fmq_msg_chunk_frame (self, &chunk_frame, &chunk_offset) == 0);
+        fmq_msg_set_id (self, FMQ_MSG_HUGZ);
+        fmq_msg_send (self, output);
+        fmq_msg_recv (self, input);
+        assert (zmq_msg_size (&chunk_frame) >= chunk_offset + 12);
+        assert (memcmp ((byte *) zmq_msg_data (&chunk_frame) + chunk_offset,
+                        "Captcha Diem", 12) == 0);
+        zmq_msg_close (&chunk_frame);
+        fmq_msg_set_id (self, FMQ_MSG_CHEEZBURGER);
+    }
+    assert (memcmp (zmq_msg_data (&shared_frame), "Captcha Diem", 12) == 0);
+    zmq_msg_close (&shared_frame);
+    fmq_msg_set_chunk_trailing (self, false);
     fmq_msg_set_id (self, FMQ_MSG_HUGZ);
 
     //  Send twice
@@ -1197,6 +1585,53 @@ fmq_msg_test (bool verbose)
         fmq_msg_recv (self, input);
         assert (fmq_msg_routing_id (self));
     }
+    fmq_msg_set_id (self, FMQ_MSG_IHAZ);
+
+    fmq_msg_set_filename (self, "Life is short but Now lasts for ever");
+    zhash_t *ihaz_headers = zhash_new ();
+    zhash_insert (ihaz_headers, "Name", "Brutus");
+    fmq_msg_set_headers (self, &ihaz_headers);
+    //  Send twice
+    fmq_msg_send (self, output);
+    fmq_msg_send (self, output);
+
+    for (instance = 0; instance < 2; instance++) {
+        fmq_msg_recv (self, input);
+        assert (fmq_msg_routing_id (self));
+        assert (streq (fmq_msg_filename (self), "Life is short but Now lasts for ever"));
+        assert (zhash_size (fmq_msg_headers (self)) == 1);
+    }
+    //  Decoding keeps the entries of the last message's hash where it
+    //  can, and drops the keys the new message lacks
+    fmq_msg_t *sender = fmq_msg_new ();
+    fmq_msg_set_id (sender, FMQ_MSG_IHAZ);
+    fmq_msg_set_filename (sender, "Life is short but Now lasts for ever");
+    zhash_t *sender_headers = zhash_new ();
+    zhash_insert (sender_headers, "Name", "Brutus");
+    zhash_insert (sender_headers, "Age", "44");
+    fmq_msg_set_headers (sender, &sender_headers);
+    fmq_msg_send (sender, output);
+    fmq_msg_recv (self, input);
+    assert (zhash_size (fmq_msg_headers (self)) == 2);
+    const char *reused = (const char *) zhash_lookup (fmq_msg_headers (self), "Name");
+    sender_headers = zhash_new ();
+    zhash_insert (sender_headers, "Name", "Cato");
+    zhash_insert (sender_headers, "Age", "45");
+    fmq_msg_set_headers (sender, &sender_headers);
+    fmq_msg_send (sender, output);
+    fmq_msg_recv (self, input);
+    assert (zhash_size (fmq_msg_headers (self)) == 2);
+    assert (zhash_lookup (fmq_msg_headers (self), "Name") == reused);
+    assert (streq (reused, "Cato"));
+    sender_headers = zhash_new ();
+    zhash_insert (sender_headers, "Name", "Brutus");
+    fmq_msg_set_headers (sender, &sender_headers);
+    fmq_msg_send (sender, output);
+    fmq_msg_recv (self, input);
+    assert (zhash_size (fmq_msg_headers (self)) == 1);
+    assert (streq ((char *) zhash_lookup (fmq_msg_headers (self), "Name"),
+                   "Brutus"));
+    fmq_msg_destroy (&sender);
     fmq_msg_set_id (self, FMQ_MSG_SRSLY);
 
     fmq_msg_set_reason (self, "Life is short but Now lasts for ever");
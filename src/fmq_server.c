@@ -16,6 +16,76 @@
     Server class implementation of FileMQ.
 @discuss
     This is the server side implementation of the FileMQ protocol.
+
+    The server reads these options from its configuration tree, which
+    the caller can change at any time with the SET command:
+
+        server/express_size     Files up to this many bytes, and all
+                                deletes, are sent ahead of any bulk
+                                transfer in progress (default 65536)
+        server/queue_limit      Patches queued for one client before its
+                                queue collapses into a resync from the
+                                mount snapshot; 0 means no limit
+                                (default 10000). A patch names a file
+                                and holds none of its content, so this
+                                bounds memory per client to a few
+                                hundred bytes a patch.
+        server/journal          Directory for the change journal; clients
+                                that reconnect get only the changes since
+                                their last position in it (default none)
+        server/journal_segment  Bytes per journal segment (default
+                                4194304)
+        server/journal_keep     Journal segments kept; clients further
+                                behind get a resync (default 64)
+        server/block_index      Blocks we remember sending, so clients
+                                that hold a block already copy it rather
+                                than fetch it; 0 turns this off
+                                (default 1000000)
+        server/content_index    File contents we remember the paths of,
+                                so clients that hold the same content
+                                under another path copy it rather than
+                                fetch it (default 100000)
+        server/chunk_cache      Bytes of file chunks we keep, so clients
+                                fetching the same content share reads;
+                                0 turns this off (default 16000000)
+        server/settle           Msecs a changed file must go unmodified
+                                before we send it, so a file that is
+                                being written goes out once, finished;
+                                0 sends changes at once (default 1000)
+        server/settle_suffix    Files named with this suffix, such as
+                                ".part", are still being written and are
+                                never sent (default none)
+        server/settle_lock      A file is still being written while a
+                                file of the same name plus this suffix,
+                                such as ".lock", exists; lock files are
+                                never sent (default none)
+        server/coalesce         Msecs within which we send any one file
+                                at most once; later changes wait, and go
+                                out as the newest version. A file held
+                                back this long goes out anyway, settled
+                                or not; 0 turns this off (default 0, or
+                                5000 when server/coalesce_paths is set)
+        server/coalesce_paths   Regular expression for the paths that
+                                server/coalesce applies to (default all)
+
+    Besides the generated actor commands, the server accepts these, and
+    replies "SUCCESS" or "FAILURE" to each:
+
+        PUBLISH location alias  Publish a directory under an alias
+        REPUBLISH location alias
+                                Re-point a published alias at another
+                                directory; the new tree is scanned in the
+                                background and clients get only the
+                                differences, once it is swapped in
+        UNPUBLISH alias         Stop publishing an alias; its queued
+                                patches are dropped but transfers under
+                                way are allowed to finish
+
+    REPUBLISH replies once the scan has started. When the scan is done the
+    server sends "REPUBLISHED", the alias, and "SUCCESS" or "FAILURE", so
+    callers that send other commands meanwhile must expect it among the
+    replies. A later REPUBLISH or UNPUBLISH of the alias abandons the
+    scan, and no REPUBLISHED follows for it.
 @end
 */
 
@@ -31,10 +101,43 @@ typedef struct _client_t client_t;
 //  Additional forward declarations
 typedef struct _sub_t sub_t;
 typedef struct _mount_t mount_t;
+typedef struct _node_t node_t;
+typedef struct _scan_t scan_t;
+typedef struct _block_t block_t;
 
 //  There's no point making these configurable
 #define CHUNK_SIZE      1000000
 
+//  Default for server/express_size; files up to this many bytes, and all
+//  deletes, go through the express lane ahead of bulk transfers
+#define EXPRESS_SIZE    "65536"
+
+//  Default for server/queue_limit; a client with more patches than this
+//  queued has its queue collapsed into a resync from the mount snapshot
+#define QUEUE_LIMIT     "10000"
+
+//  Defaults for server/journal_segment and server/journal_keep
+#define JOURNAL_SEGMENT "4194304"
+#define JOURNAL_KEEP    "64"
+
+//  Default for server/block_index
+#define BLOCK_INDEX     "1000000"
+
+//  Defaults for server/content_index and server/chunk_cache, and the
+//  number of paths we remember for any one content digest
+#define CONTENT_INDEX   "100000"
+#define CHUNK_CACHE     "16000000"
+#define CONTENT_PATHS   4
+
+//  We check that a file we're sending hasn't changed every INTACT_CHUNKS
+//  chunks we read of it, and before its end
+#define INTACT_CHUNKS   16
+
+//  Defaults for server/settle and server/coalesce; we only coalesce when
+//  asked to, and COALESCE is the window for server/coalesce_paths alone
+#define SETTLE          "1000"
+#define COALESCE        "5000"
+
 //  This structure defines the context for each running server. Store
 //  whatever properties and structures you need for the server.
 
@@ -46,6 +149,18 @@ struct _server_t {
     
     //  Properties not generated by gsl
     zlist_t *mounts;            //  Mount points
+    node_t *registry;           //  Mount points, by alias
+    zlist_t *scans;             //  Background scans for REPUBLISH
+    zlist_t *woken;             //  Clients with new patches to dispatch
+    fmq_journal_t *journal;     //  Change journal, if configured
+    zhash_t *blocks;            //  Blocks we've sent, by block digest
+    zlist_t *block_keys;        //  Digests of blocks, oldest first
+    zhash_t *contents;          //  Paths of file contents, by digest
+    zlist_t *content_keys;      //  Digests of contents, oldest first
+    zhash_t *content_paths;     //  Digest of each path in contents
+    zhash_t *chunks;            //  Frames we've read, by content and range
+    zlist_t *chunk_keys;        //  Keys of chunks, oldest first
+    size_t chunk_bytes;         //  Total size of chunks we hold
 };
 
 //  ---------------------------------------------------------------------------
@@ -60,54 +175,343 @@ struct _client_t {
 
     //  Properties not generated by gsl
     uint64_t credit;            //  Credit remaining
-    zlist_t *patches;           //  Patches to send
+    zlist_t *patches;           //  Patches to send, bulk lane
+    zlist_t *express;           //  Deletes and small files, sent first
     zdir_patch_t *patch;        //  Current patch
+    bool bulk;                  //  Current patch came from bulk lane
     zfile_t *file;              //  Current file we're sending
     off_t offset;               //  Offset of next read in file
+    long modified_nsec;         //  Sub-second mtime of file as we opened it
+    size_t unchecked;           //  Chunks read since we checked the file
+    zhash_t *reads;             //  Those chunks, to cache once we have
+    zdir_patch_t *held_patch;   //  Bulk patch held back by express lane
+    zfile_t *held_file;         //  File for held patch
+    off_t held_offset;          //  Offset of next read in held file
+    long held_modified_nsec;    //  Sub-second mtime of held file
+    fmq_blocks_t *blocks;       //  Blocks of current file, if by blocks
+    size_t block_nbr;           //  Next block to send
+    fmq_blocks_t *held_blocks;  //  Blocks of held file, if by blocks
+    size_t held_block_nbr;      //  Next block to send in held file
     uint64_t sequence;          //  Sequence number for chunck
+    zlist_t *subs;              //  Our subscriptions, owned by mounts
+    bool resync;                //  Queue collapsed, resync when caught up
+    bool woken;                 //  Client is on server wake list
+    bool chunk_trailing;        //  Client takes chunks as trailing frames
+    bool move_ok;               //  Client can move files it holds
+    zhash_t *moves;             //  Queued moves, source vpath by target
+    bool attr_ok;               //  Client can update file properties
+    bool blocks_ok;             //  Client can copy blocks it holds
+    bool copy_ok;               //  Client can copy files it holds
+    bool ihaz_ok;               //  Client can say it holds a file's content
+    bool offered;               //  Content digest sent for current file
+    bool sized;                 //  File size sent for current file
+    zhash_t *attrs;             //  Queued property updates, by vpath
+    zhash_t *restarts;          //  Files we stopped sending part way
 };
 
 //  Include the generated server engine
 #include "fmq_server_engine.inc"
 
+//  ---------------------------------------------------------------------------
+//  Path index node. Each node stands for one path component and holds the
+//  items attached at that path, so walking a path down from the root meets
+//  every item attached at that path or any of its prefixes.
+//
+
+struct _node_t {
+    char *name;                 //  Path component, NULL at root
+    node_t *parent;             //  Parent node, NULL at root
+    zhash_t *children;          //  Child nodes, by name
+    zlist_t *items;             //  Items attached at this path
+};
+
+//  --------------------------------------------------------------------------
+//  Copy the next component of *path_p into name and move past it. Returns
+//  false if there are no more components.
+
+static bool
+s_path_next (const char **path_p, char *name, size_t max_size)
+{
+    const char *path = *path_p;
+    while (*path == '/')
+        path++;
+    size_t length = strcspn (path, "/");
+    if (length == 0)
+        return false;
+    *path_p = path + length;
+    if (length >= max_size)
+        length = max_size - 1;
+    memcpy (name, path, length);
+    name [length] = 0;
+    return true;
+}
+
+//  --------------------------------------------------------------------------
+//  Constructor for the node class
+//
+
+static node_t *
+node_new (node_t *parent, const char *name)
+{
+    node_t *self = (node_t *) zmalloc (sizeof (node_t));
+    self->parent = parent;
+    self->name = name? strdup (name): NULL;
+    self->children = zhash_new ();
+    self->items = zlist_new ();
+    return self;
+}
+
+//  --------------------------------------------------------------------------
+//  Destructor for the node class, destroys all child nodes but not the
+//  items attached to them
+//
+
+static void
+node_destroy (node_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        node_t *self = *self_p;
+        node_t *child = (node_t *) zhash_first (self->children);
+        while (child) {
+            node_destroy (&child);
+            child = (node_t *) zhash_next (self->children);
+        }
+        zhash_destroy (&self->children);
+        zlist_destroy (&self->items);
+        free (self->name);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Return the node for a path below this one, creating any missing nodes
+//  if create is true; otherwise returns NULL if there is no such node.
+//
+
+static node_t *
+node_lookup (node_t *self, const char *path, bool create)
+{
+    char name [256];
+    node_t *node = self;
+    while (node && s_path_next (&path, name, sizeof (name))) {
+        node_t *child = (node_t *) zhash_lookup (node->children, name);
+        if (!child && create) {
+            child = node_new (node, name);
+            zhash_insert (node->children, name, child);
+        }
+        node = child;
+    }
+    return node;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the deepest node along a path below this one that has items
+//  attached, or NULL if there is none; this is the longest prefix match.
+//
+
+static node_t *
+node_match (node_t *self, const char *path)
+{
+    char name [256];
+    node_t *node = self;
+    node_t *match = zlist_size (node->items)? node: NULL;
+    while (node && s_path_next (&path, name, sizeof (name))) {
+        node = (node_t *) zhash_lookup (node->children, name);
+        if (node && zlist_size (node->items))
+            match = node;
+    }
+    return match;
+}
+
+//  --------------------------------------------------------------------------
+//  Attach an item at a path below this node
+//
+
+static void
+node_attach (node_t *self, const char *path, void *item)
+{
+    node_t *node = node_lookup (self, path, true);
+    zlist_append (node->items, item);
+}
+
+//  --------------------------------------------------------------------------
+//  Detach an item from a path below this node, pruning nodes that no
+//  longer lead to any items
+//
+
+static void
+node_detach (node_t *self, const char *path, void *item)
+{
+    node_t *node = node_lookup (self, path, false);
+    if (node) {
+        zlist_remove (node->items, item);
+        while (node->parent
+        &&  zlist_size (node->items) == 0
+        &&  zhash_size (node->children) == 0) {
+            node_t *parent = node->parent;
+            zhash_delete (parent->children, node->name);
+            node_destroy (&node);
+            node = parent;
+        }
+    }
+}
+
+//  ---------------------------------------------------------------------------
+//  Where we last sent a block: in the file at vpath, while that file had
+//  the given content digest, at offset. A client that holds that file as
+//  it was can copy the block from its own copy.
+//
+
+struct _block_t {
+    char *vpath;                //  Virtual path of file
+    char *digest;               //  Content digest of file
+    off_t offset;               //  Offset of block in file
+};
+
+static block_t *
+block_new (const char *vpath, const char *digest, off_t offset)
+{
+    block_t *self = (block_t *) zmalloc (sizeof (block_t));
+    if (self) {
+        self->vpath = strdup (vpath);
+        self->digest = strdup (digest);
+        self->offset = offset;
+    }
+    return self;
+}
+
+static void
+block_destroy (block_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        block_t *self = *self_p;
+        free (self->vpath);
+        free (self->digest);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Callback when we remove a block from the server's blocks table
+static void
+s_block_free (void *argument)
+{
+    block_t *block = (block_t *) argument;
+    block_destroy (&block);
+}
+
+//  Callback when we remove paths from the server's contents table
+static void
+s_paths_free (void *argument)
+{
+    zlist_t *paths = (zlist_t *) argument;
+    while (zlist_size (paths))
+        free (zlist_pop (paths));
+    zlist_destroy (&paths);
+}
+
+//  Callback when we remove a patch from a mount's held table
+static void
+s_patch_free (void *argument)
+{
+    zdir_patch_t *patch = (zdir_patch_t *) argument;
+    zdir_patch_destroy (&patch);
+}
+
+//  Callback when we remove a frame from the server's chunks table
+static void
+s_frame_free (void *argument)
+{
+    zmq_msg_t *frame = (zmq_msg_t *) argument;
+    zmq_msg_close (frame);
+    free (frame);
+}
+
+//  Callback when ZeroMQ is done with a frame built on a chunk's data
+static void
+s_chunk_release (void *data, void *hint)
+{
+    zchunk_t *chunk = (zchunk_t *) hint;
+    zchunk_destroy (&chunk);
+}
+
+
 //  ---------------------------------------------------------------------------
 //  Subscription object
 //
 
 struct _sub_t {
     client_t *client;           //  Always refers to live client
+    mount_t *mount;             //  Mount point we're subscribed on
     char *path;                 //  Path client is subscribed to
     zhash_t *cache;             //  Client's cache list
+    zlist_t *walk;              //  Paths still to visit in a resync
+    zlist_t *gone;              //  Files to delete in a resync, by vpath
+    bool caching;               //  Client has more of its cache to send
 };
 
+//  Digest we put in a client's cache when we no longer know what the
+//  client holds for a file, so any resync will reconcile it
+#define DIGEST_UNKNOWN  ""
+
+//  --------------------------------------------------------------------------
+//  Return true if vpath is the same as path, or lies below it
+
+static bool
+s_path_covers (const char *path, const char *vpath)
+{
+    size_t length = strlen (path);
+    while (length && path [length - 1] == '/')
+        length--;
+    return strncmp (vpath, path, length) == 0
+        && (vpath [length] == 0 || vpath [length] == '/');
+}
+
+//  --------------------------------------------------------------------------
+//  Return the virtual path for a key in the client's cache, as a fresh
+//  string. Clients may name files relative to the subscription path, in
+//  which case we prefix them with that path so we can do a consistent
+//  match. Directory keys end in '/', and "./" names the subscription path.
+
+static char *
+s_sub_vpath (sub_t *self, const char *key)
+{
+    if (*key == '/')
+        return strdup (key);
+
+    size_t path_len = strlen (self->path);
+    while (path_len && self->path [path_len - 1] == '/')
+        path_len--;
+    if (streq (key, "./"))
+        key = "";
+    char *vpath = (char *) malloc (path_len + strlen (key) + 2);
+    memcpy (vpath, self->path, path_len);
+    vpath [path_len] = '/';
+    strcpy (vpath + path_len + 1, key);
+    return vpath;
+}
+
 //  --------------------------------------------------------------------------
 //  Constructor for the sub (a.k.a. subscription) class
 //
 
 static sub_t *
-sub_new (client_t *client, const char *path, zhash_t *cache)
+sub_new (client_t *client, mount_t *mount, const char *path)
 {
     sub_t *self = (sub_t *) zmalloc (sizeof (sub_t));
     self->client = client;
+    self->mount = mount;
     self->path = strdup (path);
-    self->cache = zhash_dup (cache);
-
-    //  Cached filenames may be local, in which case prefix them with
-    //  the subscription path so we can do a consistent match.
-
-    sub_t *cache_item = (sub_t *) zhash_first (self->cache);
-    while (cache_item) {
-        char *key = (char *) zhash_cursor (self->cache);
-        if (*key != '/') {
-            size_t new_key_len = strlen (self->path) + strlen (key) + 2;
-            char *new_key = (char *) calloc (new_key_len, sizeof (char));
-            snprintf (new_key, new_key_len, "%s/%s", self->path, key);
-            zsys_debug ("sub_new: new_key=%s", new_key);
-            zhash_rename (self->cache, key, new_key);
-            free (new_key);
-        }
-        cache_item = (sub_t *) zhash_next (self->cache);
-    }
+    self->cache = zhash_new ();
+    zhash_autofree (self->cache);
+    self->walk = zlist_new ();
+    zlist_autofree (self->walk);
+    self->gone = zlist_new ();
+    zlist_autofree (self->gone);
+    zlist_append (client->subs, self);
     return self;
 }
 
@@ -121,7 +525,10 @@ sub_destroy (sub_t **self_p)
     assert (self_p);
     if (*self_p) {
         sub_t *self = *self_p;
+        zlist_remove (self->client->subs, self);
         zhash_destroy (&self->cache);
+        zlist_destroy (&self->walk);
+        zlist_destroy (&self->gone);
         free (self->path);
         free (self);
         *self_p = NULL;
@@ -129,6 +536,291 @@ sub_destroy (sub_t **self_p)
 }
 
 
+//  --------------------------------------------------------------------------
+//  Return true if patch belongs in the express lane: deletes always do,
+//  and so do files no larger than server/express_size bytes.
+
+static bool
+s_patch_is_express (server_t *server, zdir_patch_t *patch)
+{
+    if (zdir_patch_op (patch) == patch_delete)
+        return true;
+    off_t express_size = (off_t) atol (
+        zconfig_resolve (server->config, "server/express_size", EXPRESS_SIZE));
+    return zfile_cursize (zdir_patch_file (patch)) <= express_size;
+}
+
+//  --------------------------------------------------------------------------
+//  Return the file properties we send for a create patch: its modification
+//  time and, where we have them, its permission bits. We read them from
+//  disk as we send them, since the patch may have been queued a while and
+//  a later change may have been folded into it.
+
+static zhash_t *
+s_patch_headers (zdir_patch_t *patch)
+{
+    zhash_t *headers = zhash_new ();
+    zhash_autofree (headers);
+    zfile_t *file = zdir_patch_file (patch);
+    time_t modified = zfile_modified (file);
+    char value [32];
+#if defined (__UNIX__)
+    struct stat stat_buf;
+    if (stat (zfile_filename (file, NULL), &stat_buf) == 0) {
+        modified = stat_buf.st_mtime;
+        snprintf (value, sizeof (value), "%o", (uint) (stat_buf.st_mode & 07777));
+        zhash_insert (headers, "MODE", value);
+    }
+#else
+    if (zsys_file_exists (zfile_filename (file, NULL)))
+        modified = zsys_file_modified (zfile_filename (file, NULL));
+#endif
+    snprintf (value, sizeof (value), "%lld", (long long) modified);
+    zhash_insert (headers, "MTIME", value);
+    return headers;
+}
+
+//  --------------------------------------------------------------------------
+//  Remove any patch for the same file as 'patch' from a patch list.
+//  Returns true if a patch was removed.
+
+static bool
+s_patch_list_purge (zlist_t *list, zdir_patch_t *patch)
+{
+    zdir_patch_t *existing = (zdir_patch_t *) zlist_first (list);
+    while (existing) {
+        if (streq (zdir_patch_vpath (patch), zdir_patch_vpath (existing))) {
+            zsys_debug ("!!! removing patch !!!");
+            zsys_debug ("path=%s, op=%d, vpath=%s", zdir_patch_path (existing),
+                zdir_patch_op (existing), zdir_patch_vpath (existing));
+            zlist_remove (list, existing);
+            zdir_patch_destroy (&existing);
+            return true;
+        }
+        existing = (zdir_patch_t *) zlist_next (list);
+    }
+    return false;
+}
+
+//  --------------------------------------------------------------------------
+//  Return true if the client has anything queued, held or in flight for
+//  the file at vpath, so it may not yet hold what its cache says
+
+static bool
+client_path_pending (client_t *self, const char *vpath)
+{
+    zlist_t *lanes [] = { self->express, self->patches };
+    uint lane_nbr;
+    for (lane_nbr = 0; lane_nbr < 2; lane_nbr++) {
+        zdir_patch_t *queued = (zdir_patch_t *) zlist_first (lanes [lane_nbr]);
+        while (queued) {
+            if (streq (zdir_patch_vpath (queued), vpath))
+                return true;
+            queued = (zdir_patch_t *) zlist_next (lanes [lane_nbr]);
+        }
+    }
+    return (self->patch && streq (zdir_patch_vpath (self->patch), vpath))
+        || (self->held_patch && streq (zdir_patch_vpath (self->held_patch), vpath));
+}
+
+//  --------------------------------------------------------------------------
+//  Drop anything the client has queued, held or in flight for the file
+//  that patch touches, since patch supersedes it. The client starts afresh
+//  on any file we stopped sending part way.
+
+static void
+client_drop_patch (client_t *self, zdir_patch_t *patch)
+{
+    if (!s_patch_list_purge (self->express, patch))
+        s_patch_list_purge (self->patches, patch);
+
+    //  A held bulk transfer for the same file is now stale; if we resumed
+    //  it after the express lane it would undo this patch on the client
+    if (self->held_patch
+    &&  streq (zdir_patch_vpath (patch), zdir_patch_vpath (self->held_patch))) {
+        zsys_debug ("client_drop_patch: dropping held transfer");
+        zdir_patch_destroy (&self->held_patch);
+        zfile_destroy (&self->held_file);
+        fmq_blocks_destroy (&self->held_blocks);
+        zhash_update (self->restarts, zdir_patch_vpath (patch), (void *) "1");
+    }
+    //  Likewise a transfer in flight, rather than finish sending a version
+    //  of the file that is already out of date
+    if (self->patch && self->file
+    &&  streq (zdir_patch_vpath (patch), zdir_patch_vpath (self->patch))) {
+        zsys_debug ("client_drop_patch: aborting transfer in flight");
+        zdir_patch_destroy (&self->patch);
+        zfile_destroy (&self->file);
+        fmq_blocks_destroy (&self->blocks);
+        zhash_update (self->restarts, zdir_patch_vpath (patch), (void *) "1");
+    }
+    zhash_delete (self->moves, zdir_patch_vpath (patch));
+    zhash_delete (self->attrs, zdir_patch_vpath (patch));
+}
+
+//  --------------------------------------------------------------------------
+//  Drop the create the client has queued for the file at vpath, if it
+//  would only send the content the client says it holds. Returns true if
+//  we dropped one.
+
+static bool
+client_drop_held (client_t *self, const char *vpath, const char *digest)
+{
+    zlist_t *lanes [] = { self->express, self->patches };
+    uint lane_nbr;
+    for (lane_nbr = 0; lane_nbr < 2; lane_nbr++) {
+        zdir_patch_t *queued = (zdir_patch_t *) zlist_first (lanes [lane_nbr]);
+        while (queued) {
+            if (streq (zdir_patch_vpath (queued), vpath)) {
+                if (zdir_patch_op (queued) != patch_create
+                ||  !zdir_patch_digest (queued)
+                ||  strneq (zdir_patch_digest (queued), digest))
+                    return false;
+                zsys_debug ("client_drop_held: client holds %s", vpath);
+                zlist_remove (lanes [lane_nbr], queued);
+                zdir_patch_destroy (&queued);
+                return true;
+            }
+            queued = (zdir_patch_t *) zlist_next (lanes [lane_nbr]);
+        }
+    }
+    return false;
+}
+
+//  --------------------------------------------------------------------------
+//  Merge a batch of the client's cache into the subscription cache. Clients
+//  may send their cache in several batches. Where we queued a file for the
+//  client before its batch told us it holds it, we drop that. Otherwise
+//  the cache keeps tracking what the client will hold once its queue
+//  drains.
+//
+
+static void
+sub_cache_merge (sub_t *self, zhash_t *cache)
+{
+    const char *digest = (const char *) zhash_first (cache);
+    while (digest) {
+        char *vpath = s_sub_vpath (self, zhash_cursor (cache));
+        if (client_drop_held (self->client, vpath, digest)
+        ||  !client_path_pending (self->client, vpath))
+            zhash_update (self->cache, vpath, (void *) digest);
+        free (vpath);
+        digest = (const char *) zhash_next (cache);
+    }
+}
+
+//  --------------------------------------------------------------------------
+//  Forget the content we know the file at vpath holds, if any
+
+static void
+s_server_content_remove (server_t *self, const char *vpath)
+{
+    const char *digest = (const char *) zhash_lookup (self->content_paths, vpath);
+    zlist_t *paths = digest?
+        (zlist_t *) zhash_lookup (self->contents, digest): NULL;
+    char *path = paths? (char *) zlist_first (paths): NULL;
+    while (path && strneq (path, vpath))
+        path = (char *) zlist_next (paths);
+    if (path) {
+        zlist_remove (paths, path);
+        free (path);
+    }
+    zhash_delete (self->content_paths, vpath);
+}
+
+//  --------------------------------------------------------------------------
+//  Remember that the file at vpath holds content with the given digest.
+//  We keep the last few paths for each digest, and at most
+//  server/content_index digests, dropping the oldest.
+
+static void
+s_server_content_add (server_t *self, const char *digest, const char *vpath)
+{
+    size_t limit = (size_t) atol (zconfig_resolve (self->config,
+        "server/content_index", CONTENT_INDEX));
+    const char *known = (const char *) zhash_lookup (self->content_paths, vpath);
+    if (!limit || (known && streq (known, digest)))
+        return;
+    s_server_content_remove (self, vpath);
+
+    zlist_t *paths = (zlist_t *) zhash_lookup (self->contents, digest);
+    if (!paths) {
+        while (zhash_size (self->contents) >= limit
+        &&     zlist_size (self->content_keys)) {
+            char *oldest = (char *) zlist_pop (self->content_keys);
+            zlist_t *dropped = (zlist_t *) zhash_lookup (self->contents, oldest);
+            char *path = dropped? (char *) zlist_first (dropped): NULL;
+            while (path) {
+                zhash_delete (self->content_paths, path);
+                path = (char *) zlist_next (dropped);
+            }
+            zhash_delete (self->contents, oldest);
+            free (oldest);
+        }
+        paths = zlist_new ();
+        zhash_insert (self->contents, digest, paths);
+        zhash_freefn (self->contents, digest, s_paths_free);
+        zlist_append (self->content_keys, (void *) digest);
+    }
+    if (zlist_size (paths) == CONTENT_PATHS) {
+        char *path = (char *) zlist_pop (paths);
+        zhash_delete (self->content_paths, path);
+        free (path);
+    }
+    zlist_append (paths, strdup (vpath));
+    zhash_update (self->content_paths, vpath, (void *) digest);
+}
+
+//  --------------------------------------------------------------------------
+//  Add a chunk to the server's chunk cache, which holds at most
+//  server/chunk_cache bytes, dropping the oldest chunks. Takes ownership
+//  of the frame.
+
+static void
+s_server_chunk_add (server_t *self, const char *key, zmq_msg_t *frame)
+{
+    size_t limit = (size_t) atol (
+        zconfig_resolve (self->config, "server/chunk_cache", CHUNK_CACHE));
+    if (zhash_lookup (self->chunks, key) || zmq_msg_size (frame) > limit) {
+        s_frame_free (frame);
+        return;
+    }
+    while (self->chunk_bytes + zmq_msg_size (frame) > limit
+    &&     zlist_size (self->chunk_keys)) {
+        char *oldest = (char *) zlist_pop (self->chunk_keys);
+        zmq_msg_t *dropped = (zmq_msg_t *) zhash_lookup (self->chunks, oldest);
+        self->chunk_bytes -= zmq_msg_size (dropped);
+        zhash_delete (self->chunks, oldest);
+        free (oldest);
+    }
+    zhash_insert (self->chunks, key, frame);
+    zhash_freefn (self->chunks, key, s_frame_free);
+    zlist_append (self->chunk_keys, (void *) key);
+    self->chunk_bytes += zmq_msg_size (frame);
+}
+
+//  --------------------------------------------------------------------------
+//  Drop the chunks we hold of the content with the given digest, which a
+//  file no longer holds, so that no client gets them for that content
+
+static void
+s_server_chunks_drop (server_t *self, const char *digest)
+{
+    size_t length = strlen (digest);
+    size_t count = zlist_size (self->chunk_keys);
+    while (count--) {
+        char *key = (char *) zlist_pop (self->chunk_keys);
+        if (strncmp (key, digest, length) == 0 && key [length] == ':') {
+            zmq_msg_t *dropped = (zmq_msg_t *) zhash_lookup (self->chunks, key);
+            self->chunk_bytes -= zmq_msg_size (dropped);
+            zhash_delete (self->chunks, key);
+        }
+        else
+            zlist_append (self->chunk_keys, key);
+        free (key);
+    }
+}
+
 //  --------------------------------------------------------------------------
 //  Add patch to sub client patches list
 //
@@ -144,34 +836,34 @@ sub_patch_add (sub_t *self, zdir_patch_t *patch)
     //  Skip file creation if client already has identical file
     //  Populate the digest for the associated patch
     zdir_patch_digest_set (patch);
+    if (zdir_patch_op (patch) == patch_create && zdir_patch_digest (patch))
+        s_server_content_add (self->client->server,
+            zdir_patch_digest (patch), zdir_patch_vpath (patch));
+    else
+        s_server_content_remove (self->client->server,
+            zdir_patch_vpath (patch));
     if (zdir_patch_op (patch) == patch_create) {
         char *digest = (char *) zhash_lookup (self->cache,
-                        zdir_patch_vpath (patch) + strlen(self->path) + 1);
+                        zdir_patch_vpath (patch));
         if (digest && streq (digest, zdir_patch_digest (patch))) {
             zsys_debug ("sub_patch_add: skipping patch");
             return;             //  Just skip patch for this client
         }
     }
     //  Remove any previous patches for the same file
-    zdir_patch_t *existing = (zdir_patch_t *) zlist_first (self->client->patches);
-    while (existing) {
-        if (streq (zdir_patch_vpath (patch), zdir_patch_vpath (existing))) {
-            zsys_debug ("!!! removing patch !!!");
-            zsys_debug ("path=%s, op=%d, vpath=%s", zdir_patch_path (existing),
-                zdir_patch_op (existing), zdir_patch_vpath (existing));
-            zlist_remove (self->client->patches, existing);
-            zdir_patch_destroy (&existing);
-            break;
-        }
-        existing = (zdir_patch_t *) zlist_next (self->client->patches);
-    }
+    client_t *client = self->client;
+    client_drop_patch (client, patch);
+
+    //  The cache tracks what the client will hold once its queue drains
     if (zdir_patch_op (patch) == patch_create) {
         zsys_debug ("---> inserting patch <---");
         zsys_debug ("path=%s, op=%d, vpath=%s", zdir_patch_path (patch),
             zdir_patch_op (patch), zdir_patch_vpath (patch));
-        zhash_insert (self->cache,
-            zdir_patch_digest (patch), zdir_patch_vpath (patch));
+        zhash_update (self->cache,
+            zdir_patch_vpath (patch), (void *) zdir_patch_digest (patch));
     }
+    else
+        zhash_delete (self->cache, zdir_patch_vpath (patch));
 
     zsys_debug ("+++ adding following patch to client list +++");
     zsys_debug ("path=%s, op=%d, vpath=%s", zdir_patch_path (patch),
@@ -180,7 +872,9 @@ sub_patch_add (sub_t *self, zdir_patch_t *patch)
     //  Track that we've queued patch for client, so we don't do it twice
     zdir_patch_t *patch_add = zdir_patch_dup (patch);
     if (patch_add) {
-        int rc = zlist_append (self->client->patches, (void *) patch_add);
+        zlist_t *lane = s_patch_is_express (client->server, patch)?
+            client->express: client->patches;
+        int rc = zlist_append (lane, (void *) patch_add);
         if (rc != 0)
             zsys_error ("unable to append new patch +++");
     }
@@ -188,6 +882,240 @@ sub_patch_add (sub_t *self, zdir_patch_t *patch)
         zsys_error ("unable to duplicate patch");
 }
 
+//  --------------------------------------------------------------------------
+//  Queue a move for a file that patch deletes and target creates afresh
+//  with the same content, so the client renames the file it holds rather
+//  than fetching it again. We only do this if the client takes moves, the
+//  subscription covers both paths, and the client holds the source as it
+//  is, with nothing queued or in flight for either path. Returns true if
+//  we queued the move; the create patch for target, when it reaches this
+//  subscription, then finds the client holds the file and is skipped.
+
+static bool
+sub_move_add (sub_t *self, zdir_patch_t *patch, zdir_patch_t *target)
+{
+    client_t *client = self->client;
+    const char *source = zdir_patch_vpath (patch);
+    const char *vpath = zdir_patch_vpath (target);
+    const char *held = (const char *) zhash_lookup (self->cache, source);
+    const char *digest = (const char *) zhash_lookup (self->cache, vpath);
+    zdir_patch_digest_set (target);
+    if (!client->move_ok
+    ||  !s_path_covers (self->path, vpath)
+    ||  !held || !zdir_patch_digest (target)
+    ||  strneq (held, zdir_patch_digest (target))
+    ||  (digest && streq (digest, zdir_patch_digest (target))))
+        return false;
+
+    //  The client holds the source only if nothing for it is pending
+    if (client_path_pending (client, source)
+    || (client->patch && streq (zdir_patch_vpath (client->patch), vpath))
+    || (client->held_patch && streq (zdir_patch_vpath (client->held_patch), vpath)))
+        return false;
+    zsys_debug ("sub_move_add: moving %s to %s", source, vpath);
+    client_drop_patch (client, target);
+    zhash_update (self->cache, vpath, (void *) zdir_patch_digest (target));
+    zhash_delete (self->cache, source);
+
+    //  The move goes out as the target's create patch, which carries no
+    //  data once we find it in the moves table
+    zdir_patch_t *patch_add = zdir_patch_dup (target);
+    if (patch_add) {
+        zhash_update (client->moves, vpath, (void *) source);
+        zlist_append (client->express, patch_add);
+    }
+    else
+        zsys_error ("unable to duplicate patch");
+    return true;
+}
+
+//  --------------------------------------------------------------------------
+//  Queue a property update for a file that patch creates, if the client
+//  takes those and will hold the same content as patch once its queue
+//  drains, so that only the file's properties have changed. Returns true
+//  if we queued the update. We only get here for a zdir patch, and zdir
+//  makes one only when a file's modification time or size changes, so a
+//  chmod alone goes unnoticed until the file next changes. Where a create
+//  for the file is already queued we leave it to that, as we read the
+//  properties afresh when we send it.
+
+static bool
+sub_attr_add (sub_t *self, zdir_patch_t *patch)
+{
+    client_t *client = self->client;
+    if (!client->attr_ok || zdir_patch_op (patch) != patch_create)
+        return false;
+    const char *vpath = zdir_patch_vpath (patch);
+    const char *digest = (const char *) zhash_lookup (self->cache, vpath);
+    zdir_patch_digest_set (patch);
+    if (!digest || !zdir_patch_digest (patch)
+    ||  strneq (digest, zdir_patch_digest (patch))
+    ||  (client->patch && streq (zdir_patch_vpath (client->patch), vpath)))
+        return false;
+    //  A file we stopped sending part way goes again in full
+    if (zhash_lookup (client->restarts, vpath))
+        return false;
+
+    //  A queued create or move already carries the properties
+    zlist_t *lanes [] = { client->express, client->patches };
+    uint lane_nbr;
+    for (lane_nbr = 0; lane_nbr < 2; lane_nbr++) {
+        zdir_patch_t *queued = (zdir_patch_t *) zlist_first (lanes [lane_nbr]);
+        while (queued) {
+            if (streq (zdir_patch_vpath (queued), vpath))
+                return true;
+            queued = (zdir_patch_t *) zlist_next (lanes [lane_nbr]);
+        }
+    }
+    if (client->held_patch && streq (zdir_patch_vpath (client->held_patch), vpath))
+        return true;
+
+    zsys_debug ("sub_attr_add: properties changed for %s", vpath);
+    zdir_patch_t *patch_add = zdir_patch_dup (patch);
+    if (patch_add) {
+        zhash_update (client->attrs, vpath, (void *) "1");
+        zlist_append (client->express, patch_add);
+    }
+    else
+        zsys_error ("unable to duplicate patch");
+    return true;
+}
+
+//  ---------------------------------------------------------------------------
+//  Forget what the client will hold at vpath, for a patch we're not going
+//  to send, so that a later resync reconciles that file one way or the
+//  other.
+
+static void
+client_forget_path (client_t *self, const char *vpath)
+{
+    sub_t *sub = (sub_t *) zlist_first (self->subs);
+    while (sub) {
+        if (s_path_covers (sub->path, vpath))
+            zhash_update (sub->cache, vpath, (void *) DIGEST_UNKNOWN);
+        sub = (sub_t *) zlist_next (self->subs);
+    }
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Collapse the client's patch queue into a single resync marker, which we
+//  resolve from the mount snapshots once the client has caught up. This
+//  keeps server memory independent of how fast the client reads.
+
+static void
+client_collapse_queue (client_t *self)
+{
+    zsys_warning ("client queue is over limit, collapsing into resync");
+    zlist_t *lanes [] = { self->express, self->patches };
+    uint lane_nbr;
+    for (lane_nbr = 0; lane_nbr < 2; lane_nbr++) {
+        while (zlist_size (lanes [lane_nbr])) {
+            zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (lanes [lane_nbr]);
+            client_forget_path (self, zdir_patch_vpath (patch));
+            zdir_patch_destroy (&patch);
+        }
+    }
+    if (self->held_patch) {
+        client_forget_path (self, zdir_patch_vpath (self->held_patch));
+        zdir_patch_destroy (&self->held_patch);
+        zfile_destroy (&self->held_file);
+        fmq_blocks_destroy (&self->held_blocks);
+    }
+    //  The client still holds the source of each move we dropped
+    const char *source = (const char *) zhash_first (self->moves);
+    while (source) {
+        client_forget_path (self, source);
+        source = (const char *) zhash_next (self->moves);
+    }
+    zhash_purge (self->moves);
+    zhash_purge (self->attrs);
+    self->resync = true;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return true if the client has as many patches queued as we allow, so
+//  that we should collapse its queue rather than add to it; a limit of 0
+//  means no limit
+
+static bool
+client_queue_full (client_t *self, size_t queue_limit)
+{
+    return queue_limit
+        && zlist_size (self->express) + zlist_size (self->patches)
+           >= queue_limit;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Put the client on the server wake list, so it gets a dispatch event
+//  once the current round of changes has been routed
+
+static void
+client_wake (client_t *self)
+{
+    if (!self->woken) {
+        self->woken = true;
+        zlist_append (self->server->woken, self);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Remember where we sent each block of a file, once we've sent it all,
+//  so that clients that hold the file can copy those blocks from it. We
+//  keep at most server/block_index blocks, dropping the oldest.
+//
+
+static void
+s_server_blocks_index (server_t *self, zdir_patch_t *patch,
+                       fmq_blocks_t *blocks)
+{
+    size_t limit = (size_t) atol (
+        zconfig_resolve (self->config, "server/block_index", BLOCK_INDEX));
+    if (!zdir_patch_digest (patch) || fmq_blocks_size (blocks) > limit)
+        return;
+
+    size_t index;
+    for (index = 0; index < fmq_blocks_size (blocks); index++) {
+        const char *digest = fmq_blocks_digest (blocks, index);
+        block_t *block = block_new (zdir_patch_vpath (patch),
+            zdir_patch_digest (patch), fmq_blocks_offset (blocks, index));
+        if (!zhash_lookup (self->blocks, digest)) {
+            while (zhash_size (self->blocks) >= limit
+            &&     zlist_size (self->block_keys)) {
+                char *oldest = (char *) zlist_pop (self->block_keys);
+                zhash_delete (self->blocks, oldest);
+                free (oldest);
+            }
+            zlist_append (self->block_keys, (void *) digest);
+        }
+        zhash_update (self->blocks, digest, block);
+        zhash_freefn (self->blocks, digest, s_block_free);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the change journal, opening it the first time we need it once
+//  server/journal is set; NULL if there is no journal
+//
+
+static fmq_journal_t *
+s_server_journal (server_t *self)
+{
+    const char *path = zconfig_resolve (self->config, "server/journal", "");
+    if (!self->journal && *path)
+        self->journal = fmq_journal_new (path,
+            atol (zconfig_resolve (self->config,
+                  "server/journal_segment", JOURNAL_SEGMENT)),
+            atol (zconfig_resolve (self->config,
+                  "server/journal_keep", JOURNAL_KEEP)));
+    return self->journal;
+}
+
+
 //  --------------------------------------------------------------------------
 //  Mount point in memory
 //
@@ -197,8 +1125,19 @@ struct _mount_t {
     char *alias;            //  Alias into our tree
     zdir_t *dir;            //  Directory snapshot
     zlist_t *subs;          //  Client subscriptions
+    node_t *index;          //  Client subscriptions, by path
+    fmq_merkle_t *merkle;   //  Merkle tree over snapshot, built on demand
+    bool merkle_dirty;      //  Snapshot changed since tree was built
+    zhash_t *held;          //  Creates held back, by vpath
+    zhash_t *recent;        //  Files sent or held back lately, by vpath
 };
 
+//  Recent change to a file, for coalescing
+typedef struct {
+    int64_t held;           //  When we first held back a change, or 0
+    int64_t sent;           //  When we last sent a change, or 0
+} recent_t;
+
 //  --------------------------------------------------------------------------
 //  Constructor for the mount class
 //  Loads directory tree if possible
@@ -207,48 +1146,437 @@ struct _mount_t {
 static mount_t *
 mount_new (char *location, char *alias)
 {
-    //  Mount path must start with '/'
-    //  We'll do better error handling later
-    assert (*alias == '/');
-    
-    mount_t *self = (mount_t *) zmalloc (sizeof (mount_t));
-    self->location = strdup (location);
-    self->alias = strdup (alias);
-    self->dir = zdir_new (self->location, NULL);
-    self->subs = zlist_new ();
-    return self;
+    //  Mount path must start with '/'
+    //  We'll do better error handling later
+    assert (*alias == '/');
+    
+    mount_t *self = (mount_t *) zmalloc (sizeof (mount_t));
+    self->location = strdup (location);
+    self->alias = strdup (alias);
+    self->dir = zdir_new (self->location, NULL);
+    self->subs = zlist_new ();
+    self->index = node_new (NULL, NULL);
+    self->held = zhash_new ();
+    self->recent = zhash_new ();
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destructor for the mount class
+//
+
+static void
+mount_destroy (mount_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        mount_t *self = *self_p;
+        free (self->location);
+        free (self->alias);
+        //  Destroy subscriptions
+        while (zlist_size (self->subs)) {
+            sub_t *sub = (sub_t *) zlist_pop (self->subs);
+            sub_destroy (&sub);
+        }
+        zlist_destroy (&self->subs);
+        node_destroy (&self->index);
+        zdir_destroy (&self->dir);
+        fmq_merkle_destroy (&self->merkle);
+        zhash_destroy (&self->held);
+        zhash_destroy (&self->recent);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the Merkle tree over the current snapshot, building it if the
+//  snapshot has changed since we last did. Nothing builds the tree until a
+//  client needs it, and a rebuild only digests files that have changed.
+//
+
+static fmq_merkle_t *
+mount_merkle (mount_t *self)
+{
+    if (!self->merkle || self->merkle_dirty) {
+        fmq_merkle_t *merkle = fmq_merkle_new (self->dir, self->merkle);
+        fmq_merkle_destroy (&self->merkle);
+        self->merkle = merkle;
+        self->merkle_dirty = false;
+    }
+    return self->merkle;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return a virtual path in this mount as a path relative to the mount
+//  location, as the Merkle tree names it
+//
+
+static const char *
+mount_path (mount_t *self, const char *vpath)
+{
+    size_t length = strlen (self->alias);
+    while (length && self->alias [length - 1] == '/')
+        length--;
+    const char *path = vpath + length;
+    while (*path == '/')
+        path++;
+    return path;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the virtual path for a path relative to the mount location, as a
+//  fresh string. Directories get a trailing '/', as in the client's cache.
+//
+
+static char *
+mount_vpath (mount_t *self, const char *path, bool dir)
+{
+    size_t length = strlen (self->alias);
+    while (length && self->alias [length - 1] == '/')
+        length--;
+    char *vpath = (char *) malloc (length + strlen (path) + 3);
+    memcpy (vpath, self->alias, length);
+    vpath [length] = '/';
+    strcpy (vpath + length + 1, path);
+    if (dir && *path)
+        strcat (vpath, "/");
+    return vpath;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Reloads directory tree and returns true if activity, false if the same
+//
+
+static bool
+    mount_dispatch (mount_t *self, server_t *server, zlist_t *patches,
+                    zhash_t *moves);
+
+//  --------------------------------------------------------------------------
+//  Find files that moved, among the deletes and creates in a list of
+//  patches. A moved file keeps its size and modification time, and we
+//  confirm each match by content digest, taking the old digest from the
+//  Merkle tree, so call this before we swap in the new directory. Returns
+//  the matching create patches, keyed by the vpath of each delete, and
+//  moves those deletes to the head of the list, so clients get each move
+//  before the create that would otherwise send the file again.
+//
+
+static zhash_t *
+mount_moves (mount_t *self, zlist_t *patches)
+{
+    zhash_t *moves = zhash_new ();
+    zhash_t *creates = zhash_new ();
+    char key [64];
+    zdir_patch_t *patch = (zdir_patch_t *) zlist_first (patches);
+    while (patch) {
+        if (zdir_patch_op (patch) == patch_create) {
+            zfile_t *file = zdir_patch_file (patch);
+            snprintf (key, sizeof (key), "%lld:%lld",
+                (long long) zfile_cursize (file), (long long) zfile_modified (file));
+            zlist_t *list = (zlist_t *) zhash_lookup (creates, key);
+            if (!list) {
+                list = zlist_new ();
+                zhash_insert (creates, key, list);
+            }
+            zlist_append (list, patch);
+        }
+        patch = (zdir_patch_t *) zlist_next (patches);
+    }
+    zlist_t *moved = zlist_new ();
+    patch = zhash_size (creates)? (zdir_patch_t *) zlist_first (patches): NULL;
+    while (patch) {
+        if (zdir_patch_op (patch) == patch_delete) {
+            zfile_t *file = zdir_patch_file (patch);
+            snprintf (key, sizeof (key), "%lld:%lld",
+                (long long) zfile_cursize (file), (long long) zfile_modified (file));
+            zlist_t *list = (zlist_t *) zhash_lookup (creates, key);
+            const char *digest = list? fmq_merkle_digest (mount_merkle (self),
+                mount_path (self, zdir_patch_vpath (patch))): NULL;
+            zdir_patch_t *target = digest? (zdir_patch_t *) zlist_first (list): NULL;
+            while (target) {
+                zdir_patch_digest_set (target);
+                if (zdir_patch_digest (target)
+                &&  streq (digest, zdir_patch_digest (target))) {
+                    zsys_debug ("mount_moves: %s moved to %s",
+                        zdir_patch_vpath (patch), zdir_patch_vpath (target));
+                    zhash_insert (moves, zdir_patch_vpath (patch), target);
+                    zlist_append (moved, patch);
+                    zlist_remove (list, target);
+                    break;
+                }
+                target = (zdir_patch_t *) zlist_next (list);
+            }
+        }
+        patch = (zdir_patch_t *) zlist_next (patches);
+    }
+    patch = (zdir_patch_t *) zlist_first (moved);
+    while (patch) {
+        zlist_remove (patches, patch);
+        zlist_push (patches, patch);
+        patch = (zdir_patch_t *) zlist_next (moved);
+    }
+    zlist_destroy (&moved);
+    zlist_t *list = (zlist_t *) zhash_first (creates);
+    while (list) {
+        zlist_destroy (&list);
+        list = (zlist_t *) zhash_next (creates);
+    }
+    zhash_destroy (&creates);
+    return moves;
+}
+
+//  --------------------------------------------------------------------------
+//  Return true if a vpath names a file that is still being written by
+//  convention, by its suffix, so we never send it
+//
+
+static bool
+s_path_transient (server_t *server, const char *vpath)
+{
+    const char *keys [] = { "server/settle_suffix", "server/settle_lock" };
+    uint index;
+    for (index = 0; index < 2; index++) {
+        const char *suffix = zconfig_resolve (server->config, keys [index], "");
+        size_t length = strlen (suffix);
+        if (length && strlen (vpath) >= length
+        &&  streq (vpath + strlen (vpath) - length, suffix))
+            return true;
+    }
+    return false;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Drop the patches for files named as transient, which never go out, nor
+//  do their deletes
+//
+
+static void
+s_patches_drop_transient (server_t *server, zlist_t *patches)
+{
+    zdir_patch_t *patch = (zdir_patch_t *) zlist_first (patches);
+    while (patch) {
+        if (s_path_transient (server, zdir_patch_vpath (patch))) {
+            zlist_remove (patches, patch);
+            zdir_patch_destroy (&patch);
+        }
+        patch = (zdir_patch_t *) zlist_next (patches);
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the sub-second part of a file's mtime, in nsecs, where the file
+//  system gives it us, else 0
+//
+
+#if defined (__UNIX__)
+static long
+s_stat_modified_nsec (struct stat *stat_buf)
+{
+#if defined (__UTYPE_LINUX)
+    return stat_buf->st_mtim.tv_nsec;
+#else
+    return 0;
+#endif
+}
+#endif
+
+
+//  --------------------------------------------------------------------------
+//  Return when a file was last modified, in msecs since the epoch. Where
+//  the file system only gives us whole seconds, we take the file as
+//  modified at the end of its second, so we never think it older than it
+//  is.
+//
+
+static int64_t
+s_file_modified_msecs (zfile_t *file)
+{
+#if defined (__UTYPE_LINUX)
+    struct stat stat_buf;
+    if (stat (zfile_filename (file, NULL), &stat_buf) == 0)
+        return (int64_t) stat_buf.st_mtime * 1000
+             + s_stat_modified_nsec (&stat_buf) / 1000000;
+#endif
+    return (int64_t) zfile_modified (file) * 1000 + 999;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return true if the file a create patch refers to has settled, so we can
+//  send it. It must not have changed for server/settle msecs, to the
+//  millisecond where the file system allows, nor have a lock file. For a
+//  patch we held back, we restat the file first, and any change since we
+//  last looked means it is still being written.
+//
+
+static bool
+s_patch_settled (server_t *server, zdir_patch_t *patch, bool held)
+{
+    zfile_t *file = zdir_patch_file (patch);
+    const char *lock = zconfig_resolve (server->config, "server/settle_lock", "");
+    if (*lock) {
+        char *filename = zsys_sprintf ("%s%s", zfile_filename (file, NULL), lock);
+        bool locked = zsys_file_exists (filename);
+        free (filename);
+        if (locked)
+            return false;
+    }
+    if (held) {
+        off_t size = zfile_cursize (file);
+        time_t modified = zfile_modified (file);
+        zfile_restat (file);
+        if (zfile_cursize (file) != size || zfile_modified (file) != modified)
+            return false;
+    }
+    int64_t settle = atol (zconfig_resolve (server->config, "server/settle", SETTLE));
+    return zclock_time () - s_file_modified_msecs (file) >= settle;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the coalescing window for a vpath, 0 if none applies. We only
+//  coalesce if server/coalesce or server/coalesce_paths is set.
+//
+
+static int64_t
+s_coalesce_window (server_t *server, zrex_t *rex, const char *vpath)
+{
+    if (rex && !zrex_matches (rex, vpath))
+        return 0;
+    return atol (zconfig_resolve (server->config, "server/coalesce",
+                                  rex? COALESCE: "0"));
 }
 
 
 //  --------------------------------------------------------------------------
-//  Destructor for the mount class
+//  Return true if we hold back a create patch, because its file has not
+//  settled, or because we sent the same file less than a coalescing window
+//  ago. A change we've held back for a whole window goes out regardless,
+//  so a file that never stops changing still goes out once per window.
 //
 
-static void
-mount_destroy (mount_t **self_p)
+static bool
+mount_hold (mount_t *self, server_t *server, zdir_patch_t *patch,
+            int64_t window, int64_t now, bool held)
 {
-    assert (self_p);
-    if (*self_p) {
-        mount_t *self = *self_p;
-        free (self->location);
-        free (self->alias);
-        //  Destroy subscriptions
-        while (zlist_size (self->subs)) {
-            sub_t *sub = (sub_t *) zlist_pop (self->subs);
-            sub_destroy (&sub);
+    const char *vpath = zdir_patch_vpath (patch);
+    recent_t *recent = (recent_t *) zhash_lookup (self->recent, vpath);
+    if (window && recent && recent->held && now - recent->held >= window) {
+        zfile_restat (zdir_patch_file (patch));
+        return false;
+    }
+    bool hold = !s_patch_settled (server, patch, held)
+             || (window && recent && recent->sent && now - recent->sent < window);
+    if (hold && window) {
+        if (!recent) {
+            recent = (recent_t *) zmalloc (sizeof (recent_t));
+            zhash_insert (self->recent, vpath, recent);
+            zhash_freefn (self->recent, vpath, free);
         }
-        zlist_destroy (&self->subs);
-        zdir_destroy (&self->dir);
-        free (self);
-        *self_p = NULL;
+        if (!recent->held)
+            recent->held = now;
     }
+    return hold;
 }
 
 
 //  --------------------------------------------------------------------------
-//  Reloads directory tree and returns true if activity, false if the same
+//  Hold back creates for files that are still being written, or that we
+//  sent too recently, and release those we held back that may now go. A
+//  later patch for the same path replaces any we held back, so a burst of
+//  changes goes out as the newest version alone. Files named as transient
+//  never go out, nor do their deletes. We hold back only changes; files
+//  that a client gets by walking the snapshot go as they are.
 //
 
+static void
+mount_settle (mount_t *self, server_t *server, zlist_t *patches)
+{
+    const char *pattern = zconfig_resolve (server->config,
+                                           "server/coalesce_paths", "");
+    zrex_t *rex = *pattern? zrex_new (pattern): NULL;
+    if (rex && !zrex_valid (rex))
+        zsys_warning ("invalid server/coalesce_paths '%s'", pattern);
+    int64_t now = zclock_mono ();
+
+    s_patches_drop_transient (server, patches);
+    zlist_t *holding = zlist_new ();
+    zdir_patch_t *patch = (zdir_patch_t *) zlist_first (patches);
+    while (patch) {
+        const char *vpath = zdir_patch_vpath (patch);
+        zhash_delete (self->held, vpath);
+        if (zdir_patch_op (patch) == patch_create
+        &&  mount_hold (self, server, patch,
+                        s_coalesce_window (server, rex, vpath), now, false)) {
+            zsys_debug ("mount_settle: holding back %s", vpath);
+            zlist_remove (patches, patch);
+            zlist_append (holding, patch);
+        }
+        else
+        if (zdir_patch_op (patch) == patch_delete)
+            zhash_delete (self->recent, vpath);
+        patch = (zdir_patch_t *) zlist_next (patches);
+    }
+    zlist_t *keys = zhash_keys (self->held);
+    const char *vpath = (const char *) zlist_first (keys);
+    while (vpath) {
+        patch = (zdir_patch_t *) zhash_lookup (self->held, vpath);
+        if (!mount_hold (self, server, patch,
+                         s_coalesce_window (server, rex, vpath), now, true)) {
+            zsys_debug ("mount_settle: releasing %s", vpath);
+            zhash_freefn (self->held, vpath, NULL);
+            zhash_delete (self->held, vpath);
+            zlist_append (patches, patch);
+        }
+        vpath = (const char *) zlist_next (keys);
+    }
+    zlist_destroy (&keys);
+    while (zlist_size (holding)) {
+        patch = (zdir_patch_t *) zlist_pop (holding);
+        zhash_insert (self->held, zdir_patch_vpath (patch), patch);
+        zhash_freefn (self->held, zdir_patch_vpath (patch), s_patch_free);
+    }
+    zlist_destroy (&holding);
+
+    //  Note when we send each file, and forget files we sent long enough
+    //  ago that they're free to go again
+    patch = (zdir_patch_t *) zlist_first (patches);
+    while (patch) {
+        vpath = zdir_patch_vpath (patch);
+        if (zdir_patch_op (patch) == patch_create
+        &&  s_coalesce_window (server, rex, vpath)) {
+            recent_t *recent = (recent_t *) zhash_lookup (self->recent, vpath);
+            if (!recent) {
+                recent = (recent_t *) zmalloc (sizeof (recent_t));
+                zhash_insert (self->recent, vpath, recent);
+                zhash_freefn (self->recent, vpath, free);
+            }
+            recent->sent = now;
+            recent->held = 0;
+        }
+        patch = (zdir_patch_t *) zlist_next (patches);
+    }
+    keys = zhash_keys (self->recent);
+    vpath = (const char *) zlist_first (keys);
+    while (vpath) {
+        recent_t *recent = (recent_t *) zhash_lookup (self->recent, vpath);
+        if (!recent->held
+        &&  now - recent->sent >= s_coalesce_window (server, rex, vpath))
+            zhash_delete (self->recent, vpath);
+        vpath = (const char *) zlist_next (keys);
+    }
+    zlist_destroy (&keys);
+    zrex_destroy (&rex);
+}
+
 static bool
 mount_refresh (mount_t *self, server_t *server)
 {
@@ -276,23 +1604,197 @@ mount_refresh (mount_t *self, server_t *server)
         tmppatch = (zdir_patch_t *) zlist_next (patches);
     }
 
+    //  Dispatch while the old directory is current, so subscription caches
+    //  can still be checked against the tree they were built from. Files
+    //  still being written wait until they settle.
+    bool changed = zlist_size (patches) > 0;
+    mount_settle (self, server, patches);
+    zhash_t *moves = mount_moves (self, patches);
+    activity = mount_dispatch (self, server, patches, moves);
+    zhash_destroy (&moves);
+
     //  Drop old directory and replace with latest version
     zdir_destroy (&self->dir);
     self->dir = latest;
+    if (changed)
+        self->merkle_dirty = true;
 
-    //  Copy new patches to clients' patches list
-    sub_t *sub = (sub_t *) zlist_first (self->subs);
-    while (sub) {
-        zdir_patch_t *patch = (zdir_patch_t *) zlist_first (patches);
-        while (patch) {
-            sub_patch_add (sub, patch);
-            patch = (zdir_patch_t *) zlist_next (patches);
-            activity = true;
+    //  Destroy patches, they've all been copied
+    while (zlist_size (patches)) {
+        zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (patches);
+        zdir_patch_destroy (&patch);
+    }
+    zlist_destroy (&patches);
+    return activity;
+}
+
+
+//  --------------------------------------------------------------------------
+//  A directory entry in a subscription cache says the client holds just
+//  what our Merkle tree holds under that directory. Before a patch lands
+//  under such a directory we split the entry into entries for its children,
+//  down to the patched file, so the cache stays exact. An entry that no
+//  longer matches the tree tells us nothing, so we drop it.
+//
+
+static void
+mount_sub_expand (mount_t *self, sub_t *sub, const char *vpath)
+{
+    size_t length = strlen (self->alias);
+    while (length && self->alias [length - 1] == '/')
+        length--;
+    char *prefix = strdup (vpath);
+    const char *slash = vpath + length;
+    while ((slash = strchr (slash, '/'))) {
+        size_t prefix_len = slash - vpath + 1;
+        memcpy (prefix, vpath, prefix_len);
+        prefix [prefix_len] = 0;
+        const char *held = (const char *) zhash_lookup (sub->cache, prefix);
+        if (held) {
+            fmq_merkle_t *merkle = mount_merkle (self);
+            const char *path = mount_path (self, prefix);
+            const char *digest = fmq_merkle_digest (merkle, path);
+            zhash_t *children = fmq_merkle_children (merkle, path);
+            if (digest && children && streq (held, digest)) {
+                const char *child = (const char *) zhash_first (children);
+                while (child) {
+                    const char *name = zhash_cursor (children);
+                    char *key = (char *) malloc (prefix_len + strlen (name) + 1);
+                    sprintf (key, "%s%s", prefix, name);
+                    zhash_update (sub->cache, key, (void *) child);
+                    free (key);
+                    child = (const char *) zhash_next (children);
+                }
+            }
+            zhash_delete (sub->cache, prefix);
         }
-        sub = (sub_t *) zlist_next (self->subs);
+        slash++;
     }
-    
-    //  Destroy patches, they've all been copied
+    free (prefix);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Copy patches to the patches list of each client subscribed to the patch
+//  path or any of its prefixes, collapsing the queue of any client that has
+//  fallen too far behind. Where moves maps a delete to the create patch
+//  for the same file's new path, clients that can get a move instead.
+//  Clients that get work go on the server wake list. Returns true if any
+//  client got work.
+//
+
+static bool
+mount_dispatch (mount_t *self, server_t *server, zlist_t *patches,
+                zhash_t *moves)
+{
+    bool activity = false;
+    size_t queue_limit = atoi (
+        zconfig_resolve (server->config, "server/queue_limit", QUEUE_LIMIT));
+    fmq_journal_t *journal = s_server_journal (server);
+    zdir_patch_t *patch = (zdir_patch_t *) zlist_first (patches);
+    while (patch) {
+        const char *vpath = zdir_patch_vpath (patch);
+        if (journal)
+            fmq_journal_append (journal, zdir_patch_op (patch), vpath);
+        char name [256];
+        node_t *node = self->index;
+        while (node) {
+            sub_t *sub = (sub_t *) zlist_first (node->items);
+            while (sub) {
+                client_t *client = sub->client;
+                if (client->resync)
+                    ;           //  Pending resync will cover this patch
+                else {
+                    if (client_queue_full (client, queue_limit))
+                        client_collapse_queue (client);
+                    else {
+                        zdir_patch_t *target = moves?
+                            (zdir_patch_t *) zhash_lookup (moves,
+                                zdir_patch_vpath (patch)): NULL;
+                        mount_sub_expand (self, sub, zdir_patch_vpath (patch));
+                        if (target)
+                            mount_sub_expand (self, sub, zdir_patch_vpath (target));
+                        if (target && sub_move_add (sub, patch, target))
+                            ;   //  Client renames the file it holds
+                        else
+                        if (!sub_attr_add (sub, patch))
+                            sub_patch_add (sub, patch);
+                    }
+                    client_wake (client);
+                    activity = true;
+                }
+                sub = (sub_t *) zlist_next (node->items);
+            }
+            if (s_path_next (&vpath, name, sizeof (name)))
+                node = (node_t *) zhash_lookup (node->children, name);
+            else
+                node = NULL;
+        }
+        patch = (zdir_patch_t *) zlist_next (patches);
+    }
+    if (journal && zlist_size (patches))
+        fmq_journal_flush (journal);
+    return activity;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the patches that take a client from older to newer, snapshots
+//  of two different locations published under the same alias. zdir_diff
+//  matches files by their full names, which never match across locations,
+//  so we match them by name within each location. Every file in newer is
+//  a create, which clients that hold the same content skip, and every file
+//  only in older is a delete.
+
+static zlist_t *
+s_dir_rebase_diff (zdir_t *older, zdir_t *newer, const char *alias)
+{
+    zlist_t *patches = zlist_new ();
+    zhash_t *names = zhash_new ();
+    zfile_t **files = zdir_flatten (newer);
+    uint index;
+    for (index = 0; files [index]; index++) {
+        zfile_t *file = files [index];
+        zhash_insert (names, zfile_filename (file, zdir_path (newer)), file);
+    }
+    zfile_t **old_files = zdir_flatten (older);
+    for (index = 0; old_files [index]; index++) {
+        zfile_t *file = old_files [index];
+        if (!zhash_lookup (names, zfile_filename (file, zdir_path (older))))
+            zlist_append (patches, zdir_patch_new (
+                zdir_path (older), file, patch_delete, alias));
+    }
+    for (index = 0; files [index]; index++)
+        zlist_append (patches, zdir_patch_new (
+            zdir_path (newer), files [index], patch_create, alias));
+    zdir_flatten_free (&old_files);
+    zdir_flatten_free (&files);
+    zhash_destroy (&names);
+    return patches;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Re-point mount at a new location, given a snapshot of that location.
+//  Clients get only the differences between the old and new trees, and
+//  keep their subscriptions. Returns true if any client got work.
+//
+
+static bool
+mount_swap (mount_t *self, server_t *server, const char *location,
+            zdir_t *latest)
+{
+    zlist_t *patches = s_dir_rebase_diff (self->dir, latest, self->alias);
+    s_patches_drop_transient (server, patches);
+    zhash_t *moves = mount_moves (self, patches);
+    bool activity = mount_dispatch (self, server, patches, moves);
+    zhash_destroy (&moves);
+    zdir_destroy (&self->dir);
+    self->dir = latest;
+    self->merkle_dirty = true;
+    free (self->location);
+    self->location = strdup (location);
+
     while (zlist_size (patches)) {
         zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (patches);
         zdir_patch_destroy (&patch);
@@ -303,11 +1805,270 @@ mount_refresh (mount_t *self, server_t *server)
 
 
 //  --------------------------------------------------------------------------
-//  Store subscription for mount point
+//  Remove and destroy a subscription on this mount point
+//
+
+static void
+mount_sub_remove (mount_t *self, sub_t *sub)
+{
+    zlist_remove (self->subs, sub);
+    node_detach (self->index, sub->path, sub);
+    sub_destroy (&sub);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Drop patches still queued for a subscription on this mount point. The
+//  current and any held transfer are left to run to completion.
+//
+
+static void
+mount_sub_purge (mount_t *self, sub_t *sub)
+{
+    zlist_t *lanes [] = { sub->client->express, sub->client->patches };
+    size_t length = strlen (self->location);
+    int index;
+    for (index = 0; index < 2; index++) {
+        zdir_patch_t *patch = (zdir_patch_t *) zlist_first (lanes [index]);
+        while (patch) {
+            const char *filename =
+                zfile_filename (zdir_patch_file (patch), NULL);
+            if (s_path_covers (sub->path, zdir_patch_vpath (patch))
+            &&  strncmp (filename, self->location, length) == 0
+            &&  (filename [length] == '/' || filename [length] == 0)) {
+                zlist_remove (lanes [index], patch);
+                zdir_patch_destroy (&patch);
+            }
+            patch = (zdir_patch_t *) zlist_next (lanes [index]);
+        }
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return the next patch in a subscription's resync, or NULL once it's done.
+//  First we delete the files the client may hold that are gone from the
+//  Merkle tree, unless they've come back since. The walk holds only the
+//  paths still to visit, relative to the mount, with directories ending
+//  in '/', and we visit them depth first against the current Merkle tree,
+//  so a resync never holds more than one patch. Directories and files the
+//  client already holds are skipped, as are files that have gone since we
+//  listed them, and files named as transient.
+
+static zdir_patch_t *
+mount_sub_walk (mount_t *self, sub_t *sub)
+{
+    server_t *server = sub->client->server;
+    fmq_merkle_t *merkle = mount_merkle (self);
+    zdir_patch_t *patch = NULL;
+    while (!patch && zlist_size (sub->gone)) {
+        char *vpath = (char *) zlist_pop (sub->gone);
+        const char *filename = mount_path (self, vpath);
+        if (!fmq_merkle_digest (merkle, filename)
+        &&  !s_path_transient (server, vpath)) {
+            zfile_t *file = zfile_new (self->location, filename);
+            patch = zdir_patch_new (
+                self->location, file, patch_delete, self->alias);
+            zfile_destroy (&file);
+        }
+        free (vpath);
+    }
+    while (!patch && zlist_size (sub->walk)) {
+        char *path = (char *) zlist_pop (sub->walk);
+        size_t length = strlen (path);
+        if (length && path [length - 1] == '/') {
+            path [length - 1] = 0;
+            const char *digest = fmq_merkle_digest (merkle, path);
+            char *vdir = mount_vpath (self, path, true);
+            const char *held = (const char *) zhash_lookup (sub->cache, vdir);
+            bool unchanged = held && digest && streq (held, digest);
+            if (held && !unchanged)
+                zhash_delete (sub->cache, vdir);
+            free (vdir);
+
+            zhash_t *children = fmq_merkle_children (merkle, path);
+            const char *child = children && !unchanged?
+                (const char *) zhash_first (children): NULL;
+            while (child) {
+                const char *name = zhash_cursor (children);
+                char *next = (char *) malloc (length + strlen (name) + 1);
+                if (*path)
+                    sprintf (next, "%s/%s", path, name);
+                else
+                    strcpy (next, name);
+                zlist_push (sub->walk, next);
+                free (next);
+                child = (const char *) zhash_next (children);
+            }
+        }
+        else {
+            const char *digest = fmq_merkle_digest (merkle, path);
+            char *vpath = mount_vpath (self, path, false);
+            const char *held = (const char *) zhash_lookup (sub->cache, vpath);
+            if (digest && !fmq_merkle_children (merkle, path)
+            &&  !(held && streq (held, digest))
+            &&  !s_path_transient (server, vpath)) {
+                zfile_t *file = zfile_new (self->location, path);
+                patch = zdir_patch_new (
+                    self->location, file, patch_create, self->alias);
+                zfile_destroy (&file);
+            }
+            free (vpath);
+        }
+        free (path);
+    }
+    return patch;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Start bringing a subscription up to date with the current snapshot. We
+//  list the files the client may hold that are gone from the Merkle tree,
+//  and start a walk of the tree under the subscription path. Both feed the
+//  client's queue as it drains, so a resync never fills the queue.
+
+static void
+mount_sub_resync (mount_t *self, sub_t *sub)
+{
+    fmq_merkle_t *merkle = mount_merkle (self);
+    zlist_purge (sub->walk);
+    zlist_purge (sub->gone);
+    if (s_path_covers (self->alias, sub->path)) {
+        const char *path = mount_path (self, sub->path);
+        char *start = (char *) malloc (strlen (path) + 2);
+        strcpy (start, path);
+        if (fmq_merkle_children (merkle, path))
+            strcat (start, "/");
+        zlist_append (sub->walk, start);
+        free (start);
+    }
+
+    zlist_t *vpaths = zhash_keys (sub->cache);
+    char *vpath = (char *) zlist_first (vpaths);
+    while (vpath) {
+        size_t length = strlen (vpath);
+        if (length && vpath [length - 1] != '/'
+        &&  s_path_covers (sub->path, vpath)
+        &&  s_path_covers (self->alias, vpath)
+        &&  !fmq_merkle_digest (merkle, mount_path (self, vpath)))
+            zlist_append (sub->gone, vpath);
+        vpath = (char *) zlist_next (vpaths);
+    }
+    zlist_destroy (&vpaths);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Note each file the journal says changed, once however often it did
+
+static int
+s_journal_touch (uint64_t sequence, int operation, const char *vpath,
+                 void *argument)
+{
+    zhash_update ((zhash_t *) argument, vpath, (void *) DIGEST_UNKNOWN);
+    return 0;
+}
+
+//  Catch a subscription up from the journal, given the client's position
+//  in it as "epoch:sequence". If the journal still holds every change
+//  since then, we queue each file those changes touched, as it is now,
+//  and return true. Otherwise the client needs a resync. A client that
+//  is far behind gets its queue collapsed into a resync, as in dispatch.
+
+static bool
+mount_sub_catch_up (mount_t *self, sub_t *sub, const char *position)
+{
+    fmq_journal_t *journal = s_server_journal (sub->client->server);
+    const char *colon = strchr (position, ':');
+    if (!journal || !colon
+    ||  strlen (fmq_journal_epoch (journal)) != (size_t) (colon - position)
+    ||  strncmp (fmq_journal_epoch (journal), position, colon - position))
+        return false;
+
+    uint64_t after = strtoull (colon + 1, NULL, 10);
+    zhash_t *touched = zhash_new ();
+    if (fmq_journal_replay (journal, after, s_journal_touch, touched)) {
+        zhash_destroy (&touched);
+        return false;
+    }
+    zsys_debug ("catching up %s from journal position %s", sub->path, position);
+    client_t *client = sub->client;
+    size_t queue_limit = atoi (zconfig_resolve (client->server->config,
+        "server/queue_limit", QUEUE_LIMIT));
+    zlist_t *vpaths = zhash_keys (touched);
+    const char *vpath = (const char *) zlist_first (vpaths);
+    //  A pending resync covers whatever we'd queue
+    while (vpath && !client->resync) {
+        if (s_path_covers (sub->path, vpath)
+        &&  s_path_covers (self->alias, vpath)) {
+            if (client_queue_full (client, queue_limit)) {
+                client_collapse_queue (client);
+                break;
+            }
+            const char *filename = mount_path (self, vpath);
+            zfile_t *file = zfile_new (self->location, filename);
+            zdir_patch_t *patch = zdir_patch_new (self->location, file,
+                zfile_is_regular (file)? patch_create: patch_delete,
+                self->alias);
+            sub_patch_add (sub, patch);
+            zdir_patch_destroy (&patch);
+            zfile_destroy (&file);
+        }
+        vpath = (const char *) zlist_next (vpaths);
+    }
+    zlist_destroy (&vpaths);
+    zhash_destroy (&touched);
+    return true;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Compare the directory digests in a batch of the client's cache with our
+//  Merkle tree, taking them out of the batch. Directories that match go in
+//  the subscription cache as they are; those that differ go into differ,
+//  with our digest, so the client can send us what it holds in them.
+//
+
+static void
+mount_sub_compare (mount_t *self, sub_t *sub, zhash_t *cache, zhash_t *differ)
+{
+    fmq_merkle_t *merkle = mount_merkle (self);
+    zlist_t *keys = zhash_keys (cache);
+    const char *key = (const char *) zlist_first (keys);
+    while (key) {
+        size_t length = strlen (key);
+        if (length && key [length - 1] == '/') {
+            char *vpath = s_sub_vpath (sub, key);
+            if (s_path_covers (sub->path, vpath)
+            &&  s_path_covers (self->alias, vpath)) {
+                const char *held = (const char *) zhash_lookup (cache, key);
+                const char *digest =
+                    fmq_merkle_digest (merkle, mount_path (self, vpath));
+                if (digest && streq (held, digest))
+                    zhash_update (sub->cache, vpath, (void *) digest);
+                else
+                    zhash_update (differ, key, (void *) (digest? digest: ""));
+            }
+            free (vpath);
+            zhash_delete (cache, key);
+        }
+        key = (const char *) zlist_next (keys);
+    }
+    zlist_destroy (&keys);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Store subscription for mount point, along with the batch of the client's
+//  cache that came with it. A client that sets the MERKLE option sends us
+//  digests of its directories, and we put those that differ from ours into
+//  differ, for the reply. Once the client has sent its whole cache and we
+//  have nothing more to ask for, we resync it if it set the RESYNC option.
 //
 
 static void
-mount_sub_store (mount_t *self, client_t *client, fmq_msg_t *request)
+mount_sub_store (mount_t *self, client_t *client, fmq_msg_t *request,
+                 zhash_t *differ)
 {
     assert (self);
     assert (self->subs);
@@ -315,68 +2076,202 @@ mount_sub_store (mount_t *self, client_t *client, fmq_msg_t *request)
     //  Store subscription along with any previous ones
     //  Coalesce subscriptions that are on same path
     const char *path = fmq_msg_path (request);
-    sub_t *sub = (sub_t *) zlist_first (self->subs);
+    sub_t *sub = (sub_t *) zlist_first (client->subs);
     while (sub) {
-        if (client == sub->client) {
-            //  If old subscription is superset/same as new, ignore new
-            if (strncmp (path, sub->path, strlen (sub->path)) == 0) {
+        if (sub->mount == self) {
+            //  If old subscription is the same as new, this is a further
+            //  batch of the client's cache
+            if (streq (sub->path, path))
+                break;
+            else
+            //  If old subscription is superset of new, ignore new
+            if (s_path_covers (sub->path, path)) {
                 zsys_debug ("new subscription already exists");
                 return;
             }
             else
             //  If new subscription is superset of old one, remove old
-            if (strncmp (sub->path, path, strlen (path)) == 0) {
+            if (s_path_covers (path, sub->path)) {
                 zsys_debug ("superset, sub->path=%s, path=%s",
                     sub->path, path);
-                zlist_remove (self->subs, sub);
-                sub_destroy (&sub);
-                sub = (sub_t *) zlist_first (self->subs);
+                mount_sub_remove (self, sub);
+                sub = (sub_t *) zlist_first (client->subs);
             }
             else
-                sub = (sub_t *) zlist_next (self->subs);
+                sub = (sub_t *) zlist_next (client->subs);
         }
         else
-            sub = (sub_t *) zlist_next (self->subs);
+            sub = (sub_t *) zlist_next (client->subs);
     }
-    //  New subscription for this client, append to our list
-    sub = sub_new (client, path, fmq_msg_cache (request));
-    zlist_append (self->subs, sub);
-
-    //  If client requested resync, send full mount contents now
-    /*
-    if (fmq_msg_options_number (client->message, "RESYNC", 0) == 1) {
-        zlist_t *patches = zdir_resync (self->dir, self->alias);
-        while (zlist_size (patches)) {
-            zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (patches);
-            sub_patch_add (sub, patch);
-            zdir_patch_destroy (&patch);
+    bool fresh = !sub;
+    if (fresh) {
+        //  New subscription for this client, append to our list and index
+        sub = sub_new (client, self, path);
+        zlist_append (self->subs, sub);
+        node_attach (self->index, sub->path, sub);
+    }
+    zhash_t *options = fmq_msg_options (request);
+    const char *position = options?
+        (const char *) zhash_lookup (options, "JOURNAL"): NULL;
+    const char *merkle = options?
+        (const char *) zhash_lookup (options, "MERKLE"): NULL;
+    const char *more = options?
+        (const char *) zhash_lookup (options, "CACHE"): NULL;
+    const char *resync = options?
+        (const char *) zhash_lookup (options, "RESYNC"): NULL;
+
+    //  A client that can catch up from the journal needs nothing more from
+    //  us, though we still note which of its directories match ours
+    bool caught_up = fresh && position
+        && mount_sub_catch_up (self, sub, position);
+
+    //  We send the client nothing while it has more of its cache to send
+    sub->caching = more && streq (more, "more");
+
+    zhash_t *cache = fmq_msg_cache (request);
+    if (cache) {
+        if (merkle && atoi (merkle)) {
+            zhash_t *ignored = zhash_new ();
+            zhash_autofree (ignored);
+            mount_sub_compare (self, sub, cache, caught_up? ignored: differ);
+            zhash_destroy (&ignored);
         }
-        zlist_destroy (&patches);
+        sub_cache_merge (sub, cache);
     }
-    */
+    if (resync && atoi (resync) && !caught_up && !sub->caching
+    &&  zhash_size (differ) == 0)
+        mount_sub_resync (self, sub);
 }
 
 
-//  --------------------------------------------------------------------------
-//  Purge subscriptions for a specified client
+//  ---------------------------------------------------------------------------
+//  Send a dispatch event to each client on the wake list, that is, only
+//  those clients whose subscriptions received patches
 //
 
 static void
-mount_sub_purge (mount_t *self, client_t *client)
+s_server_wake_clients (server_t *self)
 {
-    sub_t *sub = (sub_t *) zlist_first (self->subs);
-    while (sub) {
-        if (sub->client == client) {
-            sub_t *next = (sub_t *) zlist_next (self->subs);
-            zlist_remove (self->subs, sub);
-            sub_destroy (&sub);
-            sub = next;
+    while (zlist_size (self->woken)) {
+        client_t *client = (client_t *) zlist_pop (self->woken);
+        client->woken = false;
+        engine_send_event (client, dispatch_event);
+    }
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Background scan of the new location for a REPUBLISH. The scanner actor
+//  builds the directory snapshot off the server thread and passes it back
+//  over its pipe; the server then swaps it into the mount in one step.
+//
+
+struct _scan_t {
+    mount_t *mount;             //  Mount point being re-pointed
+    char *location;             //  New physical location
+    zactor_t *actor;            //  Scanner actor
+};
+
+static void
+s_scanner (zsock_t *pipe, void *args)
+{
+    const char *location = (const char *) args;
+    zsock_signal (pipe, 0);
+    zdir_t *dir = zdir_new (location, NULL);
+    zsock_send (pipe, "p", dir);
+
+    //  The server says TAKEN once it holds the snapshot, then waits for
+    //  us to end. If it cancels the scan we get $TERM first, and the
+    //  snapshot is still ours to destroy.
+    char *command = zstr_recv (pipe);
+    if (command && streq (command, "TAKEN")) {
+        zstr_free (&command);
+        command = zstr_recv (pipe);
+    }
+    else
+    if (command && streq (command, "$TERM"))
+        zdir_destroy (&dir);
+    zstr_free (&command);
+}
+
+static scan_t *
+scan_new (mount_t *mount, const char *location)
+{
+    scan_t *self = (scan_t *) zmalloc (sizeof (scan_t));
+    self->mount = mount;
+    self->location = strdup (location);
+    self->actor = zactor_new (s_scanner, self->location);
+    return self;
+}
+
+static void
+scan_destroy (scan_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        scan_t *self = *self_p;
+        zactor_destroy (&self->actor);
+        free (self->location);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Finish a background scan; swap the new snapshot into its mount, and
+//  tell the REPUBLISH caller it is done
+//
+
+static int
+s_server_scan_ready (zloop_t *loop, zsock_t *reader, void *argument)
+{
+    server_t *self = (server_t *) argument;
+    scan_t *scan = (scan_t *) zlist_first (self->scans);
+    while (scan && zactor_sock (scan->actor) != reader)
+        scan = (scan_t *) zlist_next (self->scans);
+    assert (scan);
+
+    zdir_t *latest = NULL;
+    zsock_recv (reader, "p", &latest);
+    zstr_send (reader, "TAKEN");
+    engine_handle_socket (self, reader, NULL);
+    zlist_remove (self->scans, scan);
+
+    if (latest) {
+        zsys_info ("republishing %s from %s", scan->mount->alias, scan->location);
+        mount_swap (scan->mount, self, scan->location, latest);
+        s_server_wake_clients (self);
+    }
+    zstr_sendx (self->pipe, "REPUBLISHED", scan->mount->alias,
+                latest? "SUCCESS": "FAILURE", NULL);
+
+    scan_destroy (&scan);
+    return 0;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Abandon any background scan for a mount point that is going away, or
+//  that we scan afresh. The command that does so replies for itself, so
+//  we say nothing here.
+//
+
+static void
+s_server_scan_cancel (server_t *self, mount_t *mount)
+{
+    scan_t *scan = (scan_t *) zlist_first (self->scans);
+    while (scan) {
+        if (scan->mount == mount) {
+            engine_handle_socket (self, zactor_sock (scan->actor), NULL);
+            zlist_remove (self->scans, scan);
+            scan_destroy (&scan);
         }
-        else
-            sub = (sub_t *) zlist_next (self->subs);
+        scan = (scan_t *) zlist_next (self->scans);
     }
 }
 
+
 //  ---------------------------------------------------------------------------
 //  Monitor the servers published directories for changes
 //
@@ -385,15 +2280,12 @@ static int
 monitor_the_server (zloop_t *loop, int timer_id, void *arg)
 {
     server_t *self = (server_t *) arg;
-    bool activity = false;
     mount_t *mount = (mount_t *) zlist_first (self->mounts);
     while (mount) {
-        if (mount_refresh (mount, self))
-            activity = true;
+        mount_refresh (mount, self);
         mount = (mount_t *) zlist_next (self->mounts);
     }
-    if (activity)
-        engine_broadcast_event (self, NULL, dispatch_event);
+    s_server_wake_clients (self);
 
     return 0;
 }
@@ -409,6 +2301,20 @@ server_initialize (server_t *self)
     //  Construct properties here
     zsys_notice ("starting filemq service");
     self->mounts = zlist_new ();
+    self->registry = node_new (NULL, NULL);
+    self->scans = zlist_new ();
+    self->woken = zlist_new ();
+    self->blocks = zhash_new ();
+    self->block_keys = zlist_new ();
+    zlist_autofree (self->block_keys);
+    self->contents = zhash_new ();
+    self->content_keys = zlist_new ();
+    zlist_autofree (self->content_keys);
+    self->content_paths = zhash_new ();
+    zhash_autofree (self->content_paths);
+    self->chunks = zhash_new ();
+    self->chunk_keys = zlist_new ();
+    zlist_autofree (self->chunk_keys);
     //  Register with the engine a function that will be called
     //  every second by the engine.
     engine_set_monitor (self, 1000, monitor_the_server);
@@ -424,11 +2330,27 @@ server_terminate (server_t *self)
 {
     //  Destroy properties here
     zsys_notice ("terminating filemq service");
+    while (zlist_size (self->scans)) {
+        scan_t *scan = (scan_t *) zlist_pop (self->scans);
+        engine_handle_socket (self, zactor_sock (scan->actor), NULL);
+        scan_destroy (&scan);
+    }
+    zlist_destroy (&self->scans);
+    zlist_destroy (&self->woken);
     while (zlist_size (self->mounts)) {
         mount_t *mount = (mount_t *) zlist_pop (self->mounts);
         mount_destroy (&mount);
     }
     zlist_destroy (&self->mounts);
+    node_destroy (&self->registry);
+    fmq_journal_destroy (&self->journal);
+    zhash_destroy (&self->blocks);
+    zlist_destroy (&self->block_keys);
+    zhash_destroy (&self->contents);
+    zlist_destroy (&self->content_keys);
+    zhash_destroy (&self->content_paths);
+    zhash_destroy (&self->chunks);
+    zlist_destroy (&self->chunk_keys);
 }
 
 //  ---------------------------------------------------------------------------
@@ -441,10 +2363,61 @@ server_method (server_t *self, const char *method, zmsg_t *msg)
     if (streq (method, "PUBLISH")) {
         char *location = zmsg_popstr (msg);
         char *alias = zmsg_popstr (msg);
-        mount_t *mount = mount_new (location, alias);
+        mount_t *mount = mount_new (location, alias);
+        zmsg_t *ret_msg = zmsg_new ();
+        if (mount) {
+            zlist_append (self->mounts, mount);
+            node_attach (self->registry, mount->alias, mount);
+            zmsg_addstr (ret_msg, "SUCCESS");
+        }
+        else
+            zmsg_addstr (ret_msg, "FAILURE");
+        free (location);
+        free (alias);
+        return ret_msg;
+    }
+    else
+    if (streq (method, "UNPUBLISH")) {
+        //  Drop the mount point at this alias. Queued patches from it are
+        //  discarded; transfers already under way are allowed to finish.
+        char *alias = zmsg_popstr (msg);
+        node_t *node = alias? node_lookup (self->registry, alias, false): NULL;
+        mount_t *mount = node? (mount_t *) zlist_first (node->items): NULL;
+        zmsg_t *ret_msg = zmsg_new ();
+        if (mount) {
+            zsys_info ("unpublishing %s from %s", mount->alias, mount->location);
+            s_server_scan_cancel (self, mount);
+            node_detach (self->registry, mount->alias, mount);
+            zlist_remove (self->mounts, mount);
+            while (zlist_size (mount->subs)) {
+                sub_t *sub = (sub_t *) zlist_first (mount->subs);
+                mount_sub_purge (mount, sub);
+                mount_sub_remove (mount, sub);
+            }
+            mount_destroy (&mount);
+            zmsg_addstr (ret_msg, "SUCCESS");
+        }
+        else
+            zmsg_addstr (ret_msg, "FAILURE");
+        free (alias);
+        return ret_msg;
+    }
+    else
+    if (streq (method, "REPUBLISH")) {
+        //  Re-point the mount point at this alias to a new location. The
+        //  new snapshot is built in the background; we reply now, and send
+        //  REPUBLISHED once it has been swapped in.
+        char *location = zmsg_popstr (msg);
+        char *alias = zmsg_popstr (msg);
+        node_t *node = alias? node_lookup (self->registry, alias, false): NULL;
+        mount_t *mount = node? (mount_t *) zlist_first (node->items): NULL;
         zmsg_t *ret_msg = zmsg_new ();
-        if (mount) {
-            zlist_append (self->mounts, mount);
+        if (mount && location) {
+            s_server_scan_cancel (self, mount);
+            scan_t *scan = scan_new (mount, location);
+            zlist_append (self->scans, scan);
+            engine_handle_socket (self, zactor_sock (scan->actor),
+                                  s_server_scan_ready);
             zmsg_addstr (ret_msg, "SUCCESS");
         }
         else
@@ -468,6 +2441,15 @@ client_initialize (client_t *self)
 {
     //  Construct properties here
     self->patches = zlist_new ();
+    self->express = zlist_new ();
+    self->subs = zlist_new ();
+    self->moves = zhash_new ();
+    zhash_autofree (self->moves);
+    self->attrs = zhash_new ();
+    zhash_autofree (self->attrs);
+    self->restarts = zhash_new ();
+    self->reads = zhash_new ();
+    zhash_autofree (self->restarts);
     return 0;
 }
 
@@ -479,18 +2461,183 @@ static void
 client_terminate (client_t *self)
 {
     //  Destroy properties here
-    mount_t *mount = (mount_t *) zlist_first (self->server->mounts);
-    while (mount) {
-        mount_sub_purge (mount, self);
-        mount = (mount_t *) zlist_next (self->server->mounts);
+    if (self->woken)
+        zlist_remove (self->server->woken, self);
+    while (zlist_size (self->subs)) {
+        sub_t *sub = (sub_t *) zlist_first (self->subs);
+        mount_sub_remove (sub->mount, sub);
     }
+    zlist_destroy (&self->subs);
     while (zlist_size (self->patches)) {
         zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (self->patches);
         zdir_patch_destroy (&patch);
     }
     zlist_destroy (&self->patches);
+    while (zlist_size (self->express)) {
+        zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (self->express);
+        zdir_patch_destroy (&patch);
+    }
+    zlist_destroy (&self->express);
     zdir_patch_destroy (&self->patch);
     zfile_destroy (&self->file);
+    zdir_patch_destroy (&self->held_patch);
+    zfile_destroy (&self->held_file);
+    fmq_blocks_destroy (&self->blocks);
+    fmq_blocks_destroy (&self->held_blocks);
+    zhash_destroy (&self->moves);
+    zhash_destroy (&self->attrs);
+    zhash_destroy (&self->restarts);
+    zhash_destroy (&self->reads);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Resolve a pending resync by queueing whatever each subscription needs
+//  to catch up with the current mount snapshots
+
+static void
+client_resync_queue (client_t *self)
+{
+    zsys_debug ("client_resync_queue: resolving resync from snapshot");
+    self->resync = false;
+    sub_t *sub = (sub_t *) zlist_first (self->subs);
+    while (sub) {
+        mount_sub_resync (sub->mount, sub);
+        sub = (sub_t *) zlist_next (self->subs);
+    }
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return true if any of the client's subscriptions has a resync walk in
+//  progress
+
+static bool
+client_walking (client_t *self)
+{
+    sub_t *sub = (sub_t *) zlist_first (self->subs);
+    while (sub) {
+        if (zlist_size (sub->walk) || zlist_size (sub->gone))
+            return true;
+        sub = (sub_t *) zlist_next (self->subs);
+    }
+    return false;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return true if any of the client's subscriptions is still waiting for
+//  more of the client's cache. Until it has it all, what we'd send may be
+//  what a later batch says the client holds.
+
+static bool
+client_caching (client_t *self)
+{
+    sub_t *sub = (sub_t *) zlist_first (self->subs);
+    while (sub) {
+        if (sub->caching)
+            return true;
+        sub = (sub_t *) zlist_next (self->subs);
+    }
+    return false;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Feed the client's empty queue from its resync walks, one patch at a
+//  time, so a large initial sync never sits in memory as patches
+
+static void
+client_walk_feed (client_t *self)
+{
+    sub_t *sub = (sub_t *) zlist_first (self->subs);
+    while (sub
+    &&     zlist_size (self->express) == 0 && zlist_size (self->patches) == 0) {
+        zdir_patch_t *patch = mount_sub_walk (sub->mount, sub);
+        if (patch) {
+            sub_patch_add (sub, patch);
+            zdir_patch_destroy (&patch);
+        }
+        else
+            sub = (sub_t *) zlist_next (self->subs);
+    }
+}
+
+
+//  ---------------------------------------------------------------------------
+//  If we stopped sending the file in the message part way before, tell
+//  the client to start the file afresh, so it keeps nothing of the version
+//  we abandoned, where holes or blocks we copy now fall
+
+static void
+client_restart_mark (client_t *self)
+{
+    const char *vpath = fmq_msg_filename (self->message);
+    if (!zhash_lookup (self->restarts, vpath))
+        return;
+    if (!fmq_msg_headers (self->message)) {
+        zhash_t *headers = zhash_new ();
+        zhash_autofree (headers);
+        fmq_msg_set_headers (self->message, &headers);
+    }
+    zhash_update (fmq_msg_headers (self->message), "RESTART", (void *) "1");
+    zhash_delete (self->restarts, vpath);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Tell the client the size of a large file with the first message we send
+//  of it, so it can reserve the space before it writes. We don't for sparse
+//  files, since the client would then fill their holes.
+
+static void
+client_size_mark (client_t *self)
+{
+    if (self->sized)
+        return;
+    self->sized = true;
+    if (zfile_cursize (self->file) <= CHUNK_SIZE)
+        return;
+#if defined (__UNIX__)
+    struct stat stat_buf;
+    if (fstat (fileno (zfile_handle (self->file)), &stat_buf)
+    ||  (off_t) stat_buf.st_blocks * 512 < stat_buf.st_size)
+        return;
+#endif
+    if (!fmq_msg_headers (self->message)) {
+        zhash_t *headers = zhash_new ();
+        zhash_autofree (headers);
+        fmq_msg_set_headers (self->message, &headers);
+    }
+    char value [32];
+    snprintf (value, sizeof (value), "%lld",
+        (long long) zfile_cursize (self->file));
+    zhash_update (fmq_msg_headers (self->message), "SIZE", value);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Once the patch we're sending leaves the client with nothing queued, the
+//  client will hold every change in the journal so far, so we tell it its
+//  position there, which it presents when it next subscribes
+
+static void
+client_journal_position (client_t *self)
+{
+    fmq_journal_t *journal = self->server->journal;
+    if (journal && self->patch == NULL && self->held_patch == NULL
+    &&  zlist_size (self->express) == 0 && zlist_size (self->patches) == 0
+    &&  !self->resync && !client_walking (self)) {
+        if (!fmq_msg_headers (self->message)) {
+            zhash_t *headers = zhash_new ();
+            zhash_autofree (headers);
+            fmq_msg_set_headers (self->message, &headers);
+        }
+        char *position = zsys_sprintf ("%s:%llu", fmq_journal_epoch (journal),
+            (unsigned long long) fmq_journal_sequence (journal));
+        zhash_update (fmq_msg_headers (self->message), "JOURNAL", position);
+        free (position);
+    }
 }
 
 
@@ -501,28 +2648,44 @@ client_terminate (client_t *self)
 static void
 store_client_subscription (client_t *self)
 {
-    //  Find mount point with longest match to subscription
+    //  Clients that can take chunks as trailing frames say so when they
+    //  subscribe; others get chunks inline, as before
+    zhash_t *options = fmq_msg_options (self->message);
+    char *chunk_frame = options?
+        (char *) zhash_lookup (options, "CHUNK-FRAME"): NULL;
+    if (chunk_frame)
+        self->chunk_trailing = atoi (chunk_frame) != 0;
+    char *move = options? (char *) zhash_lookup (options, "MOVE"): NULL;
+    if (move)
+        self->move_ok = atoi (move) != 0;
+    char *attr = options? (char *) zhash_lookup (options, "ATTR"): NULL;
+    if (attr)
+        self->attr_ok = atoi (attr) != 0;
+    char *blocks = options? (char *) zhash_lookup (options, "BLOCKS"): NULL;
+    if (blocks)
+        self->blocks_ok = atoi (blocks) != 0;
+    char *copy = options? (char *) zhash_lookup (options, "COPY"): NULL;
+    if (copy)
+        self->copy_ok = atoi (copy) != 0;
+    char *ihaz = options? (char *) zhash_lookup (options, "IHAZ"): NULL;
+    if (ihaz)
+        self->ihaz_ok = atoi (ihaz) != 0;
+
+    //  Find mount point with longest match to subscription; where
+    //  several mounts share an alias, the first published wins
     const char *path = fmq_msg_path (self->message);
+    node_t *node = node_match (self->server->registry, path);
+    mount_t *mount = node? (mount_t *) zlist_first (node->items): NULL;
 
-    mount_t *check = (mount_t *) zlist_first (self->server->mounts);
-    mount_t *mount = check;
-    while (check) {
-        //  If check->alias is prefix of path and alias is
-        //  longer than current mount then we have a new mount
-        zsys_debug ("path=%s, check->alias=%s, mount->alias=%s",
-            path, check->alias, mount->alias);
-        if (strncmp (path, check->alias, strlen (check->alias)) == 0
-        &&  strlen (check->alias) > strlen (mount->alias)) {
-            zsys_debug ("prefix match, alias is longer");
-            mount = check;
-        }
-        check = (mount_t *) zlist_next (self->server->mounts);
-    }
     //  If subscription matches nothing, discard it
+    zhash_t *differ = zhash_new ();
+    zhash_autofree (differ);
     if (mount) {
         zsys_debug ("new subscription being stored");
-        mount_sub_store (mount, self, self->message);
+        mount_sub_store (mount, self, self->message, differ);
     }
+    //  Our reply lists the client's directories that differ from ours
+    fmq_msg_set_cache (self->message, &differ);
 }
 
 
@@ -537,6 +2700,267 @@ store_client_credit (client_t *self)
 }
 
 
+//  ---------------------------------------------------------------------------
+//  Move the offset in the file we're sending past any hole there, and
+//  return how much we can read before the next hole, at most CHUNK_SIZE,
+//  so a sparse file goes out as its data extents alone. Returns 0 if only
+//  a hole is left, with the offset at end of file. Where the platform
+//  can't tell us where holes are, we read the file straight through.
+
+static size_t
+client_next_extent (client_t *self)
+{
+    size_t size = CHUNK_SIZE;
+#if defined (__UNIX__) && defined (SEEK_DATA) && defined (SEEK_HOLE)
+    int handle = fileno (zfile_handle (self->file));
+    off_t data = lseek (handle, self->offset, SEEK_DATA);
+    if (data == -1 && errno == ENXIO) {
+        off_t end = lseek (handle, 0, SEEK_END);
+        if (end > self->offset)
+            self->offset = end;
+        size = 0;
+    }
+    else
+    if (data >= self->offset) {
+        self->offset = data;
+        off_t hole = lseek (handle, data, SEEK_HOLE);
+        if (hole > data && hole - data < (off_t) size)
+            size = (size_t) (hole - data);
+    }
+#endif
+    return size;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Cut the next block of the file we're sending, if we haven't yet. We cut
+//  the file one block at a time as we send it, so the server never reads
+//  a whole large file in one go. Returns false at end of file. If we can't
+//  read the file by blocks, we send the rest of it by extents.
+
+static bool
+client_block_ready (client_t *self)
+{
+    if (self->block_nbr < fmq_blocks_size (self->blocks)
+    ||  fmq_blocks_more (self->blocks) == 0)
+        return true;
+    if (fmq_blocks_failed (self->blocks))
+        fmq_blocks_destroy (&self->blocks);
+    return false;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Move the offset in the file we're sending to the next block, and return
+//  its length; returns 0 once all blocks are sent, with the offset at end
+//  of file
+
+static size_t
+client_next_block (client_t *self)
+{
+    if (self->block_nbr == fmq_blocks_size (self->blocks))
+        return 0;
+    self->offset = fmq_blocks_offset (self->blocks, self->block_nbr);
+    return fmq_blocks_length (self->blocks, self->block_nbr);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return true if the file we're sending is still the version we set out
+//  to send: the same size and modification time as when we saw the change
+//  and, where we can tell, the same file as the one we have open
+
+static bool
+client_file_intact (client_t *self)
+{
+    zfile_t *known = zdir_patch_file (self->patch);
+#if defined (__UNIX__)
+    struct stat path_stat, open_stat;
+    if (stat (zfile_filename (known, NULL), &path_stat)
+    ||  fstat (fileno (zfile_handle (self->file)), &open_stat))
+        return false;
+    return path_stat.st_size == zfile_cursize (known)
+        && path_stat.st_mtime == zfile_modified (known)
+        && s_stat_modified_nsec (&path_stat) == self->modified_nsec
+        && path_stat.st_ino == open_stat.st_ino
+        && path_stat.st_dev == open_stat.st_dev;
+#else
+    zfile_t *current = zfile_new (NULL, zfile_filename (known, NULL));
+    bool intact = zfile_cursize (current) == zfile_cursize (known)
+               && zfile_modified (current) == zfile_modified (known);
+    zfile_destroy (&current);
+    return intact;
+#endif
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return the sub-second part of the mtime of the file we just opened to
+//  send, where we can tell, else 0
+
+static long
+client_file_modified_nsec (client_t *self)
+{
+#if defined (__UNIX__)
+    struct stat stat_buf;
+    if (fstat (fileno (zfile_handle (self->file)), &stat_buf) == 0)
+        return s_stat_modified_nsec (&stat_buf);
+#endif
+    return 0;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return true if we should check the file we're sending before the next
+//  chunk: every INTACT_CHUNKS chunks we read, and as we near its end
+
+static bool
+client_check_due (client_t *self)
+{
+    return self->unchecked >= INTACT_CHUNKS
+        || self->offset + CHUNK_SIZE >= zfile_cursize (self->file);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Check the file we're sending. If it is intact, the chunks we read of it
+//  since we last checked are good, and go into the server's chunk cache;
+//  if not, we drop them. Returns 0 if intact, -1 if the file changed.
+
+static int
+client_file_check (client_t *self)
+{
+    self->unchecked = 0;
+    if (!client_file_intact (self)) {
+        zhash_purge (self->reads);
+        return -1;
+    }
+    zlist_t *keys = zhash_keys (self->reads);
+    const char *key = (const char *) zlist_first (keys);
+    while (key) {
+        zmq_msg_t *frame = (zmq_msg_t *) zhash_lookup (self->reads, key);
+        zhash_freefn (self->reads, key, NULL);
+        zhash_delete (self->reads, key);
+        s_server_chunk_add (self->server, key, frame);
+        key = (const char *) zlist_next (keys);
+    }
+    zlist_destroy (&keys);
+    return 0;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return true if the client holds the file at vpath with the given
+//  content digest, with nothing pending for that file
+
+static bool
+client_holds (client_t *self, const char *vpath, const char *digest)
+{
+    if (client_path_pending (self, vpath))
+        return false;
+    sub_t *sub = (sub_t *) zlist_first (self->subs);
+    while (sub) {
+        if (s_path_covers (sub->path, vpath)) {
+            const char *held = (const char *) zhash_lookup (sub->cache, vpath);
+            return held && streq (held, digest);
+        }
+        sub = (sub_t *) zlist_next (self->subs);
+    }
+    return false;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return where we sent the next block of the file we're sending before,
+//  if the client holds that file as it was then, or NULL if the client
+//  may not hold the block
+
+static block_t *
+client_block_held (client_t *self)
+{
+    if (self->block_nbr == fmq_blocks_size (self->blocks))
+        return NULL;
+    block_t *block = (block_t *) zhash_lookup (self->server->blocks,
+        fmq_blocks_digest (self->blocks, self->block_nbr));
+    return block && client_holds (self, block->vpath, block->digest)?
+        block: NULL;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Return another path where the client holds the content of the file
+//  we're about to send, or NULL if we know of none
+
+static const char *
+client_content_held (client_t *self)
+{
+    const char *digest = zdir_patch_digest (self->patch);
+    zlist_t *paths = digest?
+        (zlist_t *) zhash_lookup (self->server->contents, digest): NULL;
+    const char *vpath = paths? (const char *) zlist_first (paths): NULL;
+    while (vpath) {
+        if (strneq (vpath, zdir_patch_vpath (self->patch))
+        &&  client_holds (self, vpath, digest))
+            return vpath;
+        vpath = (const char *) zlist_next (paths);
+    }
+    return NULL;
+}
+
+
+//  ---------------------------------------------------------------------------
+//  Read a chunk of the file we're sending into frame, which the caller
+//  has initialized and must close. We share reads of the same content
+//  between clients through the server's chunk cache, which holds frames
+//  that ZeroMQ counts references to, so sharing one copies no data. A
+//  chunk we read goes into the cache only once we've checked that the
+//  file was intact after we read it.
+//  Returns 0 if OK, -1 if we could not read the file.
+
+static int
+client_read (client_t *self, size_t size, zmq_msg_t *frame)
+{
+    server_t *server = self->server;
+    const char *digest = zdir_patch_digest (self->patch);
+    size_t limit = (size_t) atol (
+        zconfig_resolve (server->config, "server/chunk_cache", CHUNK_CACHE));
+    bool cached = digest && size && size <= limit;
+
+    char *key = cached? zsys_sprintf ("%s:%lld:%lu", digest,
+        (long long) self->offset, (unsigned long) size): NULL;
+    zmq_msg_t *shared = key?
+        (zmq_msg_t *) zhash_lookup (server->chunks, key): NULL;
+    if (shared) {
+        zmq_msg_copy (frame, shared);
+        free (key);
+        return 0;
+    }
+    zchunk_t *chunk = zfile_read (self->file, size, self->offset);
+    if (!chunk) {
+        free (key);
+        return -1;
+    }
+    self->unchecked++;
+    if (zchunk_size (chunk)) {
+        zmq_msg_close (frame);
+        zmq_msg_init_data (frame, zchunk_data (chunk), zchunk_size (chunk),
+            s_chunk_release, chunk);
+    }
+    else
+        zchunk_destroy (&chunk);
+
+    if (key && zmq_msg_size (frame)) {
+        shared = (zmq_msg_t *) zmalloc (sizeof (zmq_msg_t));
+        zmq_msg_init (shared);
+        zmq_msg_copy (shared, frame);
+        zhash_update (self->reads, key, shared);
+        zhash_freefn (self->reads, key, s_frame_free);
+    }
+    free (key);
+    return 0;
+}
+
+
 //  ---------------------------------------------------------------------------
 //  get_next_patch_for_client
 //
@@ -545,9 +2969,55 @@ static void
 get_next_patch_for_client (client_t *self)
 {
     zsys_debug ("@@ get_next_patch_for_client");
+    //  Express patches preempt a bulk transfer in progress; we hold the
+    //  bulk transfer and resume it once the express lane is empty
+    if (self->patch && self->bulk && !self->held_patch
+    &&  zlist_size (self->express)) {
+        zsys_debug ("~~~ holding bulk transfer for express lane ~~~");
+        self->held_patch = self->patch;
+        self->held_file = self->file;
+        self->held_offset = self->offset;
+        self->held_modified_nsec = self->modified_nsec;
+        self->held_blocks = self->blocks;
+        self->held_block_nbr = self->block_nbr;
+        zhash_purge (self->reads);
+        self->patch = NULL;
+        self->file = NULL;
+        self->blocks = NULL;
+    }
+    //  Once the client has caught up, resolve any pending resync
+    if (self->patch == NULL && self->held_patch == NULL && self->resync
+    &&  zlist_size (self->express) == 0 && zlist_size (self->patches) == 0)
+        client_resync_queue (self);
+
+    //  Queued patches go first, then any resync walk takes its turn
+    if (self->patch == NULL && self->held_patch == NULL
+    &&  zlist_size (self->express) == 0 && zlist_size (self->patches) == 0)
+        client_walk_feed (self);
+
     //  Get next patch for client if we're not doing one already
     if (self->patch == NULL) {
-        self->patch = (zdir_patch_t *) zlist_pop (self->patches);
+        self->patch = (zdir_patch_t *) zlist_pop (self->express);
+        self->bulk = false;
+        if (self->patch == NULL && self->held_patch) {
+            zsys_debug ("~~~ resuming held bulk transfer ~~~");
+            self->patch = self->held_patch;
+            self->file = self->held_file;
+            self->offset = self->held_offset;
+            self->modified_nsec = self->held_modified_nsec;
+            self->blocks = self->held_blocks;
+            self->block_nbr = self->held_block_nbr;
+            //  The file may have changed while we held it
+            self->unchecked = INTACT_CHUNKS;
+            self->held_patch = NULL;
+            self->held_file = NULL;
+            self->held_blocks = NULL;
+            self->bulk = true;
+        }
+        if (self->patch == NULL) {
+            self->patch = (zdir_patch_t *) zlist_pop (self->patches);
+            self->bulk = true;
+        }
         if (self->patch) {
             zsys_debug ("~~~ just popped following patch ~~~");
             zsys_debug ("~~~~ path=%s, op=%d, vpath=%s",
@@ -569,13 +3039,57 @@ get_next_patch_for_client (client_t *self)
 
     //  Get virtual path from patch
     fmq_msg_set_filename (self->message, zdir_patch_vpath (self->patch));
-
+    fmq_msg_set_chunk_trailing (self->message, self->chunk_trailing);
+    zhash_t *headers = NULL;
+    fmq_msg_set_headers (self->message, &headers);
+
+    //  A create patch we queued as a move carries no data; the client
+    //  renames the file it holds
+    const char *source = self->file == NULL
+                      && zdir_patch_op (self->patch) == patch_create?
+        (const char *) zhash_lookup (self->moves,
+                                     zdir_patch_vpath (self->patch)): NULL;
+    if (source) {
+        zsys_debug ("~~~ current patch is move ~~~");
+        fmq_msg_set_sequence (self->message, self->sequence++);
+        fmq_msg_set_operation (self->message, FMQ_MSG_FILE_MOVE);
+        fmq_msg_set_eof (self->message, 1);
+        zchunk_t *chunk = NULL;
+        fmq_msg_set_chunk (self->message, &chunk);
+        headers = zhash_new ();
+        zhash_autofree (headers);
+        zhash_insert (headers, "FROM", (void *) source);
+        fmq_msg_set_headers (self->message, &headers);
+        zhash_delete (self->moves, zdir_patch_vpath (self->patch));
+        //  The client drops any partial file at the target as it moves
+        zhash_delete (self->restarts, zdir_patch_vpath (self->patch));
+        zdir_patch_destroy (&self->patch);
+    }
+    else
+    //  Likewise a create patch we queued as a property update
+    if (self->file == NULL && zdir_patch_op (self->patch) == patch_create
+    &&  zhash_lookup (self->attrs, zdir_patch_vpath (self->patch))) {
+        zsys_debug ("~~~ current patch is property update ~~~");
+        fmq_msg_set_sequence (self->message, self->sequence++);
+        fmq_msg_set_operation (self->message, FMQ_MSG_FILE_ATTR);
+        fmq_msg_set_eof (self->message, 1);
+        zchunk_t *chunk = NULL;
+        fmq_msg_set_chunk (self->message, &chunk);
+        headers = s_patch_headers (self->patch);
+        fmq_msg_set_headers (self->message, &headers);
+        zhash_delete (self->attrs, zdir_patch_vpath (self->patch));
+        zdir_patch_destroy (&self->patch);
+    }
+    else
     //  We can process a delete patch right away
     if (zdir_patch_op (self->patch) == patch_delete) {
         zsys_debug ("~~~ current patch is delete ~~~");
         fmq_msg_set_sequence (self->message, self->sequence++);
         fmq_msg_set_operation (self->message, FMQ_MSG_FILE_DELETE);
         fmq_msg_set_eof (self->message, 0);
+        zchunk_t *chunk = NULL;
+        fmq_msg_set_chunk (self->message, &chunk);
+        zhash_delete (self->restarts, zdir_patch_vpath (self->patch));
 
         //  No reliability in this version, assume patch delivered safely
         zdir_patch_destroy (&self->patch);
@@ -583,6 +3097,27 @@ get_next_patch_for_client (client_t *self)
     else
     if (zdir_patch_op (self->patch) == patch_create) {
         zsys_debug ("~~~ current patch is create ~~~");
+        //  Content the client holds under another path, it copies
+        const char *holder = self->file == NULL && self->copy_ok
+                          && zfile_cursize (zdir_patch_file (self->patch))?
+            client_content_held (self): NULL;
+        if (holder) {
+            zsys_debug ("~~~ client holds content at %s ~~~", holder);
+            fmq_msg_set_sequence (self->message, self->sequence++);
+            fmq_msg_set_operation (self->message, FMQ_MSG_FILE_COPY);
+            fmq_msg_set_eof (self->message, 1);
+            zchunk_t *chunk = NULL;
+            fmq_msg_set_chunk (self->message, &chunk);
+            headers = s_patch_headers (self->patch);
+            zhash_insert (headers, "FROM", (void *) holder);
+            zhash_insert (headers, "DIGEST",
+                (void *) zdir_patch_digest (self->patch));
+            fmq_msg_set_headers (self->message, &headers);
+            zhash_delete (self->restarts, zdir_patch_vpath (self->patch));
+            zdir_patch_destroy (&self->patch);
+            client_journal_position (self);
+            return;
+        }
         //  Create patch refers to file, open that for input if needed
         if (self->file == NULL) {
             zsys_debug ("~~~ client's file is NULL ~~~");
@@ -596,38 +3131,148 @@ get_next_patch_for_client (client_t *self)
                 return;
             }
             self->offset = 0;
+            self->offered = false;
+            self->sized = false;
+            self->modified_nsec = client_file_modified_nsec (self);
+            self->unchecked = 0;
+            zhash_purge (self->reads);
+
+            //  Clients that copy blocks they hold get large files by
+            //  content-defined blocks, which we cut as we go
+            self->block_nbr = 0;
+            if (self->blocks_ok && zfile_cursize (self->file) > CHUNK_SIZE
+            &&  atol (zconfig_resolve (self->server->config,
+                                       "server/block_index", BLOCK_INDEX)))
+                self->blocks = fmq_blocks_new (
+                    zfile_filename (self->file, NULL));
+        }
+        //  If the file changed since we saw it, what we'd send would be
+        //  torn; we stop, and the client starts afresh on the change. We
+        //  check every few chunks, and always before the end of the file,
+        //  so the client never gets a torn file as finished.
+        if (client_check_due (self) && client_file_check (self)) {
+            zsys_debug ("~~~ file changed while sending, aborting ~~~");
+            if (zdir_patch_digest (self->patch))
+                s_server_chunks_drop (self->server,
+                                      zdir_patch_digest (self->patch));
+            zhash_update (self->restarts, zdir_patch_vpath (self->patch),
+                (void *) "1");
+            client_forget_path (self, zdir_patch_vpath (self->patch));
+            zdir_patch_destroy (&self->patch);
+            zfile_destroy (&self->file);
+            fmq_blocks_destroy (&self->blocks);
+            engine_set_next_event (self, next_patch_event);
+            return;
+        }
+        //  A block the client holds already goes as a reference to it.
+        //  The client reads and writes that block as it would a chunk,
+        //  so the reference costs the same credit.
+        block_t *block = self->blocks && client_block_ready (self)?
+            client_block_held (self): NULL;
+        if (block
+        &&  fmq_blocks_length (self->blocks, self->block_nbr) > self->credit) {
+            zsys_debug ("~~~ no credit ~~~");
+            engine_set_exception (self, no_credit_event);
+            return;
+        }
+        if (block) {
+            zsys_debug ("~~~ client holds block in %s ~~~", block->vpath);
+            fmq_msg_set_sequence (self->message, self->sequence++);
+            fmq_msg_set_operation (self->message, FMQ_MSG_FILE_CREATE);
+            self->offset = fmq_blocks_offset (self->blocks, self->block_nbr);
+            fmq_msg_set_offset (self->message, self->offset);
+            fmq_msg_set_eof (self->message, 0);
+            zchunk_t *chunk = NULL;
+            fmq_msg_set_chunk (self->message, &chunk);
+
+            char value [32];
+            headers = zhash_new ();
+            zhash_autofree (headers);
+            zhash_insert (headers, "BLOCK", block->vpath);
+            snprintf (value, sizeof (value), "%lld", (long long) block->offset);
+            zhash_insert (headers, "BLOCK-OFFSET", value);
+            snprintf (value, sizeof (value), "%lld",
+                (long long) fmq_blocks_length (self->blocks, self->block_nbr));
+            zhash_insert (headers, "BLOCK-SIZE", value);
+            zhash_insert (headers, "BLOCK-DIGEST",
+                (void *) fmq_blocks_digest (self->blocks, self->block_nbr));
+            fmq_msg_set_headers (self->message, &headers);
+            client_size_mark (self);
+            client_restart_mark (self);
+
+            self->offset += fmq_blocks_length (self->blocks, self->block_nbr);
+            self->credit -= fmq_blocks_length (self->blocks, self->block_nbr);
+            self->block_nbr++;
+            client_journal_position (self);
+            return;
         }
-        //  Get next chunk for file
+        //  Get next chunk for file, skipping any hole
         zsys_debug ("~~~ read chunk from file ~~~");
-        zchunk_t *chunk = zfile_read (self->file, CHUNK_SIZE, self->offset);
-        assert (chunk);
+        size_t size = self->blocks? client_next_block (self):
+                                    client_next_extent (self);
+        zmq_msg_t frame;
+        zmq_msg_init (&frame);
+        int rc = client_read (self, size, &frame);
+        assert (rc == 0);
+        size = zmq_msg_size (&frame);
 
         //  Check if we have the credit to send chunk
-        if (zchunk_size (chunk) <= self->credit) {
+        if (size <= self->credit) {
             zsys_debug ("~~~ have credit, prepare to send ~~~");
             fmq_msg_set_sequence (self->message, self->sequence++);
             fmq_msg_set_operation (self->message, FMQ_MSG_FILE_CREATE);
             fmq_msg_set_offset (self->message, self->offset);
             fmq_msg_set_eof (self->message, 0);
 
-            self->offset += zchunk_size (chunk);
-            self->credit -= zchunk_size (chunk);
-
-            //  Zero-sized chunk means end of file
-            if (zchunk_size (chunk) == 0) {
+            //  Clients that may hold the content under some path we
+            //  don't know of get its digest with the first chunk
+            if (self->ihaz_ok && !self->offered && size
+            &&  zfile_cursize (self->file) > CHUNK_SIZE
+            &&  zdir_patch_digest (self->patch)) {
+                headers = zhash_new ();
+                zhash_autofree (headers);
+                zhash_insert (headers, "DIGEST",
+                    (void *) zdir_patch_digest (self->patch));
+                fmq_msg_set_headers (self->message, &headers);
+                self->offered = true;
+            }
+            if (size)
+                client_size_mark (self);
+            self->offset += size;
+            self->credit -= size;
+            if (self->blocks && size)
+                self->block_nbr++;
+
+            //  Zero-sized chunk means end of file, and its offset is the
+            //  file size, which covers any hole at the end of the file.
+            //  We send the content digest, so the client can check it.
+            if (size == 0) {
                 zsys_debug ("~~~ chunk is empty ~~~");
                 fmq_msg_set_eof (self->message, 1);
+                headers = s_patch_headers (self->patch);
+                if (zdir_patch_digest (self->patch))
+                    zhash_insert (headers, "DIGEST",
+                        (void *) zdir_patch_digest (self->patch));
+                fmq_msg_set_headers (self->message, &headers);
+                if (self->blocks && fmq_blocks_done (self->blocks))
+                    s_server_blocks_index (self->server, self->patch,
+                                           self->blocks);
+                fmq_blocks_destroy (&self->blocks);
                 zfile_destroy (&self->file);
                 zdir_patch_destroy (&self->patch);
             }
-            fmq_msg_set_chunk (self->message, &chunk);
+            client_restart_mark (self);
+            fmq_msg_set_chunk_frame (self->message, &frame);
+            zmq_msg_close (&frame);
         }
         else {
             zsys_debug ("~~~ no credit ~~~");
-            zchunk_destroy (&chunk);
-            engine_set_next_event (self, no_credit_event);
+            zmq_msg_close (&frame);
+            //  We have nothing to send, so we skip the CHEEZBURGER
+            engine_set_exception (self, no_credit_event);
         }
     }
+    client_journal_position (self);
 }
 
 
@@ -644,7 +3289,14 @@ check_for_client_data (client_t *self)
         return;
     }
 
-    if (zlist_size (self->patches) == 0 && self->patch == NULL) {
+    if (client_caching (self)) {
+        zsys_debug ("^^^ client is sending its cache, finished event ^^^");
+        engine_set_next_event (self, finished_event);
+    }
+    else
+    if (zlist_size (self->express) == 0 && zlist_size (self->patches) == 0
+    &&  self->patch == NULL && self->held_patch == NULL && !self->resync
+    &&  !client_walking (self)) {
         zsys_debug ("^^^ client has no patches, finished event ^^^");
         engine_set_next_event (self, finished_event);
     }
@@ -677,6 +3329,76 @@ handle_client_finished (client_t *self)
 }
 
 
+//  ---------------------------------------------------------------------------
+//  Send the client the file at vpath again, as it is now, since it could
+//  not check or copy what we sent. We forget what it holds there, so that
+//  nothing skips the file, and queue it on the subscription it came by.
+
+static void
+client_resend (client_t *self, const char *vpath)
+{
+    sub_t *sub = (sub_t *) zlist_first (self->subs);
+    while (sub && !(s_path_covers (sub->path, vpath)
+                &&  s_path_covers (sub->mount->alias, vpath)))
+        sub = (sub_t *) zlist_next (self->subs);
+    if (!sub)
+        return;
+
+    zsys_debug ("~~~ client asks for %s again ~~~", vpath);
+    mount_t *mount = sub->mount;
+    zhash_update (sub->cache, vpath, (void *) DIGEST_UNKNOWN);
+    zfile_t *file = zfile_new (mount->location, mount_path (mount, vpath));
+    if (zfile_is_regular (file)) {
+        zdir_patch_t *patch = zdir_patch_new (
+            mount->location, file, patch_create, mount->alias);
+        sub_patch_add (sub, patch);
+        zdir_patch_destroy (&patch);
+        client_wake (self);
+    }
+    zfile_destroy (&file);
+}
+
+
+//  ---------------------------------------------------------------------------
+//  skip_client_file
+//
+
+static void
+skip_client_file (client_t *self)
+{
+    //  The client holds the content of the file we're sending it, so we
+    //  skip to the end, and the next chunk we send closes the file. We
+    //  take the client's word only for the content we're still sending.
+    //  A client that could not check or copy a file asks us to resend it.
+    const char *vpath = fmq_msg_filename (self->message);
+    zhash_t *headers = fmq_msg_headers (self->message);
+    if (headers && zhash_lookup (headers, "RESEND")) {
+        client_resend (self, vpath);
+        return;
+    }
+    const char *digest = headers?
+        (const char *) zhash_lookup (headers, "DIGEST"): NULL;
+    if (!digest)
+        return;
+
+    if (self->file && streq (zdir_patch_vpath (self->patch), vpath)
+    &&  zdir_patch_digest (self->patch)
+    &&  streq (zdir_patch_digest (self->patch), digest)) {
+        zsys_debug ("~~~ client holds %s, skipping it ~~~", vpath);
+        fmq_blocks_destroy (&self->blocks);
+        self->offset = zfile_cursize (self->file);
+    }
+    else
+    if (self->held_file && streq (zdir_patch_vpath (self->held_patch), vpath)
+    &&  zdir_patch_digest (self->held_patch)
+    &&  streq (zdir_patch_digest (self->held_patch), digest)) {
+        zsys_debug ("~~~ client holds %s, skipping it ~~~", vpath);
+        fmq_blocks_destroy (&self->held_blocks);
+        self->held_offset = zfile_cursize (self->held_file);
+    }
+}
+
+
 //  ---------------------------------------------------------------------------
 //  Selftest
 //
@@ -688,12 +3410,145 @@ fmq_server_test (bool verbose)
     if (verbose)
         printf ("\n");
     
+    //  Engine must implement the current model, when run from the source tree
+    zfile_t *model = zfile_new ("src", "fmq_server.xml");
+    const char *digest = zfile_digest (model);
+    if (digest && strneq (digest, FMQ_SERVER_MODEL))
+        zsys_error ("fmq_server.xml (%s) has changed, update fmq_server_engine.inc", digest);
+    assert (!digest || streq (digest, FMQ_SERVER_MODEL));
+    zfile_destroy (&model);
+
     //  @selftest
+    //  Path index finds items at a path and each of its prefixes
+    char *root = "root", *app1 = "app1", *app10 = "app10";
+    node_t *index = node_new (NULL, NULL);
+    node_attach (index, "/", root);
+    node_attach (index, "/logs/app1", app1);
+    node_attach (index, "/logs/app10", app10);
+    assert (zlist_size (index->items) == 1);
+    node_t *node = node_lookup (index, "/logs/app1", false);
+    assert (node);
+    assert (zlist_first (node->items) == app1);
+    assert (node_lookup (index, "/logs/app", false) == NULL);
+    node_detach (index, "/logs/app1", app1);
+    assert (node_lookup (index, "/logs/app1", false) == NULL);
+    assert (node_lookup (index, "/logs", false));
+    node_detach (index, "/logs/app10", app10);
+    assert (zhash_size (index->children) == 0);
+
+    //  Longest prefix match falls back to the nearest item-bearing node
+    node_attach (index, "/logs/app1", app1);
+    node = node_match (index, "/logs/app1/today");
+    assert (node && zlist_first (node->items) == app1);
+    assert (node_match (index, "/logs/app10") == index);
+    node_detach (index, "/", root);
+    assert (node_match (index, "/data") == NULL);
+    node_detach (index, "/logs/app1", app1);
+    node_destroy (&index);
+
+    //  Timer wheel only turns while some timer is armed
+    s_server_t *wheel_server = (s_server_t *) zmalloc (sizeof (s_server_t));
+    wheel_server->loop = zloop_new ();
+    s_server_wheel_init (wheel_server, 0);
+    s_timer_t timers [3];
+    int timer_nbr;
+    for (timer_nbr = 0; timer_nbr < 3; timer_nbr++) {
+        timers [timer_nbr].next = timers [timer_nbr].prev = &timers [timer_nbr];
+        timers [timer_nbr].armed = false;
+        s_timer_start (wheel_server, &timers [timer_nbr], 1000 * (timer_nbr + 1));
+    }
+    assert (wheel_server->wheel_timer);
+    assert (wheel_server->wheel_armed == 3);
+    //  Resetting a running timer does not count it twice
+    s_timer_start (wheel_server, &timers [0], 1000);
+    assert (wheel_server->wheel_armed == 3);
+    s_timer_t expired;
+    expired.next = expired.prev = &expired;
+    s_server_wheel_turn (wheel_server,
+        wheel_server->wheel_tick + 2000 / WHEEL_TICK + 1, &expired);
+    assert (expired.next == &timers [0]);
+    assert (expired.next->next == &timers [1]);
+    assert (expired.prev == &timers [1]);
+    assert (wheel_server->wheel_armed == 1);
+    s_timer_cancel (wheel_server, &timers [0]);
+    s_timer_cancel (wheel_server, &timers [1]);
+    assert (expired.next == &expired);
+    assert (wheel_server->wheel_timer);
+    s_timer_cancel (wheel_server, &timers [2]);
+    assert (wheel_server->wheel_armed == 0);
+    assert (wheel_server->wheel_timer == 0);
+    zloop_destroy (&wheel_server->loop);
+    free (wheel_server);
+
+    //  Republishing at a new location matches files by name, so files in
+    //  both locations are never deleted
+    const char *names [] = {
+        "one/same.txt", "one/gone.txt", "two/same.txt", "two/new.txt"
+    };
+    zsys_dir_create ("./fmqrebase/one");
+    zsys_dir_create ("./fmqrebase/two");
+    uint name_nbr;
+    for (name_nbr = 0; name_nbr < 4; name_nbr++) {
+        char *path = zsys_sprintf ("./fmqrebase/%s", names [name_nbr]);
+        FILE *handle = fopen (path, "w");
+        assert (handle);
+        fprintf (handle, "%s\n", names [name_nbr]);
+        fclose (handle);
+        free (path);
+    }
+    zdir_t *older = zdir_new ("./fmqrebase/one", NULL);
+    zdir_t *newer = zdir_new ("./fmqrebase/two", NULL);
+    zlist_t *patches = s_dir_rebase_diff (older, newer, "/source");
+    assert (zlist_size (patches) == 3);
+    size_t deletes = 0;
+    while (zlist_size (patches)) {
+        zdir_patch_t *patch = (zdir_patch_t *) zlist_pop (patches);
+        if (zdir_patch_op (patch) == patch_delete) {
+            assert (streq (zdir_patch_vpath (patch), "/source/gone.txt"));
+            deletes++;
+        }
+        zdir_patch_destroy (&patch);
+    }
+    assert (deletes == 1);
+    zlist_destroy (&patches);
+    zdir_destroy (&older);
+    zdir_destroy (&newer);
+    zdir_t *rebase = zdir_new ("./fmqrebase", NULL);
+    zdir_remove (rebase, true);
+    zdir_destroy (&rebase);
+
     zactor_t *server = zactor_new (fmq_server, "server");
     if (verbose)
         zstr_send (server, "VERBOSE");
     zstr_sendx (server, "BIND", "ipc://@/fmq_server", NULL);
 
+    //  Mount points can be re-pointed and removed at runtime
+    char *reply;
+    zstr_sendx (server, "PUBLISH", "./src", "/source", NULL);
+    reply = zstr_recv (server);
+    assert (streq (reply, "SUCCESS"));
+    zstr_free (&reply);
+    zstr_sendx (server, "REPUBLISH", "./include", "/source", NULL);
+    reply = zstr_recv (server);
+    assert (streq (reply, "SUCCESS"));
+    zstr_free (&reply);
+    char *alias, *status;
+    zstr_recvx (server, &reply, &alias, &status, NULL);
+    assert (streq (reply, "REPUBLISHED"));
+    assert (streq (alias, "/source"));
+    assert (streq (status, "SUCCESS"));
+    zstr_free (&reply);
+    zstr_free (&alias);
+    zstr_free (&status);
+    zstr_sendx (server, "UNPUBLISH", "/source", NULL);
+    reply = zstr_recv (server);
+    assert (streq (reply, "SUCCESS"));
+    zstr_free (&reply);
+    zstr_sendx (server, "REPUBLISH", "./src", "/source", NULL);
+    reply = zstr_recv (server);
+    assert (streq (reply, "FAILURE"));
+    zstr_free (&reply);
+
     zsock_t *client = zsock_new (ZMQ_DEALER);
     assert (client);
     zsock_set_rcvtimeo (client, 2000);